@@ -5,15 +5,29 @@
 static char *usage =
 	"ar -- compression archiver -- written by Haruhiko Okumura\n"
     "                        modifications by Terran Melconian\n\n"
-	"Usage: ar command archive [file ...]\n"
+	"Usage: ar command [-switch ...] archive [file ...]\n"
 	"Commands:\n"
 	"   a: Add files to archive (replace if present)\n"
     "   e: Extract files from archive\n"
     "   x: Extract files with path\n"
 	"   r: Replace files in archive\n"
 	"   d: Delete files from archive\n"
+	"   c: Compact archive (reclaim space of deleted files)\n"
 	"   p: Print files on standard output\n"
 	"   l: List contents of archive\n"
+	"   b: Benchmark: ar b [-oN] [-N] [file ...] (no archive)\n"
+	"Switches:\n"
+	"  -s: Compress big files in independent segments (-lhs-)\n"
+	"  -i: Keep an index of the files at the end of archive\n"
+	"  -m: Only mark replaced and deleted files, which is quick,\n"
+	"       but other LHA programs stop at them until 'c'\n"
+	"  -oN: Compress with method -lhN-, whose dictionary is\n"
+	"       5: 8K (default), 6: 32K, 7: 64K, 8: 128K\n"
+	"  -1 .. -8: Find matches by hash chains, -1 fastest\n"
+	"       (default: by the tree, slower but a little better)\n"
+	"  -9: Parse optimally, slowest but smallest\n"
+	"Archive '-' is standard output for 'a', else standard input,\n"
+	"   and file '-' is standard input, stored as STDIN.\n"
 	"If no files are named, all files in archive are processed,\n"
 	"   except for commands 'a' and 'd'.\n"
 	"You may copy, distribute, and rewrite this program freely.\n";
@@ -26,7 +40,10 @@ Structure of archive block (low order byte first):
 		= 25 + strlen(filename) (= 0 if end of archive)
  1	basic header algebraic sum (mod 256)
 -----basic header
- 5	method ("-lh0-" = stored, "-lh5-" = compressed)
+ 5	method ("-lh0-" = stored, "-lh5-" = compressed,
+		"-lh6-", "-lh7-", "-lh8-" = compressed with a bigger
+		dictionary, "-lhs-" = compressed in segments,
+		"-lh!-" = deleted)
  4	compressed size (including extended headers)
  4	original size
  4	not used
@@ -40,26 +57,156 @@ Structure of archive block (low order byte first):
 -----first extended header, etc.
 -----compressed file
 
+"-lh6-" and "-lh7-" are as in LHA, with dictionaries of 32K and 64K
+bytes; "-lh8-" (128K) is our own.  "-lh4-" files are read as
+"-lh5-".
+
+Commands 'a', 'r' and 'd' change the archive in place.  New files
+are written over the end mark, the first byte of each last of all,
+after the new end mark; so if we are stopped on the way, the archive
+is still good up to its old end, and what is after that is ignored.
+A replaced or deleted file is first marked "-lh!-" in its header.
+As other programs stop at such a file, the archive is then copied
+without it, as by command 'c'; with -m it is left marked, and the
+space is taken back by a later 'c'.
+
+An "-lhs-" file is cut into segments of SEGSIZ bytes (the last
+one may be shorter).  Each segment is compressed like a "-lh5-"
+file of its own, with a fresh dictionary and Huffman coding, and
+stored instead if it does not get smaller.  The segments follow
+one another, so each one can be expanded without the others once
+its offset is known from the segment index, which is the first
+extended header:
+ 1	0x73 (EXT_SEGMENT)
+ 4	segment length (SEGSIZ)
+ 4	compressed size of the 1st segment
+		(= original size if and only if the segment is stored;
+		 one that compresses to its own size is stored too)
+ 4	compressed size of the 2nd segment, etc.
+ 2	next extended header size (0 if none)
+
+An archive may have an index after the end mark, which other
+programs do not read.  Named files are looked up in it instead of
+going through all the headers.  'a', 'r' and 'd' keep it up to
+date, and -i makes one:
+ 4	hash of the 1st filename (see namehash())
+ 4	offset of its header
+ 4	hash of the 2nd filename, etc., in order of the hashes
+ 4	number of files (deleted ones may be included)
+ 4	offset of the end mark
+ 4	"-ix-"
+It is used only if it ends the file and its end mark is there.
+
+Archive "-" is written to standard output or read from standard
+input, in pipes, with no seeks.  As the header must give the sizes
+before the data, each STREAMSIZ bytes of a file added to it are
+compressed in memory and written as a member of their own, with the
+same name.  Each part after the first has an extended header giving
+where it goes in the file, and 'e', 'x' and 'p' put the parts together
+again.  No index is kept.  Standard input ("-" as a file) can't be
+read twice either, so it is added to any archive in the same parts,
+as STDIN; deleting or replacing a file takes its parts with it.
+
 ***********************************************************/
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <time.h>  /* clock(), for 'B' */
 #include <dir.h>
 #include "ar.h"
 
 #define FNAME_MAX (255 - 25) /* max strlen(filename) */
+#define MEMBUFSIZ (4 * DICSIZ)  /* smaller files are added in one pass */
+#define SEGSIZ (128L * DICSIZ)  /* "-lhs-" segment length */
+#if UINT_MAX > 0xFFFFU
+	#define COPYSIZ (128U * DICSIZ)  /* copy() reads this much at a time */
+#else
+	#define COPYSIZ (4U * DICSIZ)
+#endif
+#if UINT_MAX > 0xFFFFU
+	#define STREAMSIZ (128U * DICSIZ)  /* part of a file added to "-" */
+#else
+	#define STREAMSIZ MEMBUFSIZ
+#endif
+#if UINT_MAX > 0xFFFFU
+	#define FILEBUFSIZ (32U * DICSIZ)  /* stdio buffer, see set_buffer() */
+#endif
+#define EXT_SEGMENT 0x73        /* extended header: segment index */
+#define EXT_PART    0x74        /* extended header: part of a file */
+#define DEAD '!'                /* method "-lh!-": deleted */
+#define INDEXTAIL 12            /* bytes after the index entries */
 #define namelen  header[19]
 #define filename ((char *)&header[20])
 
-int unpackable;            /* global, set in io.c */
-ulong compsize, origsize;  /* global */
+static FILE *arcfile, *infile, *outfile;
+static ar_state *codec;   /* encoder for 'A' and 'R', else decoder */
+static ulong compsize, origsize;
 
 static uchar buffer[DICSIZ];
+static uchar *inbuf, *outbuf;  /* MEMBUFSIZ each (STREAMSIZ if streaming
+								  or "-" is added), for 'A' and 'R' */
+static uchar *copybuf;  /* COPYSIZ, for compact() */
+static char  *arcbuf, *filebuf;  /* FILEBUFSIZ, of arcfile and outfile */
 static uchar header[255];
 static uchar headersize, headersum;
 static uint  file_crc;
 static char  *temp_name;
+static int   segmented;  /* switch -s */
+static int   marking;    /* switch -m: leave "-lh!-" files, don't compact */
+static int   streaming;  /* archive "-" */
+static int   readstdin;  /* file "-": add() reads standard input */
+static char  stdinname[] = "STDIN";  /* what it is stored as */
+static FILE  *msgfile;   /* stdout, or stderr if that takes the data */
+static int   lhmethod = '5';  /* switch -o */
+static int   level;  /* switches -1 .. -9; 0: the tree */
+static ulong *segcomp, nsegs, segsiz;  /* segment index of "-lhs-" */
+static long endpos;  /* of the archive's end mark, for 'A', 'R' and 'D' */
+static long commitpos = -1;  /* see write_header() */
+
+typedef struct {
+	ulong hash;  /* of filename */
+	long  pos;   /* of header */
+} ixentry;
+static ixentry *ixtab;  /* the index */
+static ulong nix, ixsize;  /* entries used and allocated */
+static ulong nsorted;  /* entries in the archive's index */
+static long  ixbase;  /* where they are; 0 once loaded into ixtab[] */
+static int   indexing;  /* switch -i, or the archive has an index */
+static int   ixvalid;   /* the archive's index is there and good */
+
+static void error(char *fmt, ...)
+	/* The codec never calls this; only here does AR exit. */
+{
+	va_list args;
+
+	va_start(args, fmt);
+	putc('\n', stderr);
+	vfprintf(stderr, fmt, args);
+	putc('\n', stderr);
+	va_end(args);
+	exit(EXIT_FAILURE);
+}
+
+static void check(void)  /* stop if codec could not go on */
+{
+	if (codec->fault != NULL) error(codec->fault);
+}
+
+static int dicbit_of(int method)  /* 0 if we can't expand it */
+{
+	int d;
+
+	switch (method) {
+	case '4':  case '5':  case 's':  d = 13;  break;
+	case '6':  d = 15;  break;
+	case '7':  d = 16;  break;
+	case '8':  d = 17;  break;
+	default:   return 0;
+	}
+	return (d <= MAXDICBIT) ? d : 0;
+}
 
 static uint ratio(ulong a, ulong b)  /* [(1000a + [b/2]) / b] */
 {
@@ -103,7 +250,7 @@ static int read_header(void)
 	headersize = (uchar) fgetc(arcfile);
 	if (headersize == 0) return 0;  /* end of archive */
 	headersum  = (uchar) fgetc(arcfile);
-	fread_crc(header, headersize, arcfile);  /* CRC not used */
+	fread((char *)header, 1, headersize, arcfile);
 	if (calc_headersum() != headersum) error("Header sum error");
 	compsize = get_from_header(5, 4);
 	origsize = get_from_header(9, 4);
@@ -112,89 +259,487 @@ static int read_header(void)
 	return 1;  /* success */
 }
 
+static void put_bytes(int n, ulong x)  /* low order byte first */
+{
+	while (--n >= 0) {
+		fputc((int)(x & 0xFF), outfile);  x >>= 8;
+	}
+}
+
+static ulong get_bytes(int n)
+{
+	int i;
+	ulong s;
+
+	s = 0;
+	for (i = 0; i < n; i++) s |= (ulong)(fgetc(arcfile) & 0xFF) << (8 * i);
+	return s;
+}
+
 static void write_header(void)
+	/* At commitpos a zero goes in place of headersize, which
+	   append() puts there when the whole file is written. */
 {
-	fputc(headersize, outfile);
+	fputc((commitpos >= 0 && ftell(outfile) == commitpos) ? 0 : headersize,
+		  outfile);
 	/* We've destroyed file_crc by null-terminating filename. */
 	put_to_header(headersize - 5, 2, (ulong)file_crc);
 	fputc(calc_headersum(), outfile);
-	fwrite_crc(header, headersize, outfile);  /* CRC not used */
+	if (fwrite((char *)header, 1, headersize, outfile) != headersize)
+		error("Can't write");
+}
+
+static void set_buffer(FILE *f, char **buf)
+	/* Call before the first read or write of f.  Fewer and
+	   larger requests: each is a round trip to a network disk. */
+{
+#ifdef FILEBUFSIZ
+	if (*buf == NULL && (*buf = malloc(FILEBUFSIZ)) == NULL) return;
+	setvbuf(f, *buf, _IOFBF, FILEBUFSIZ);
+#endif
+}
+
+static void skip_bytes(ulong n)  /* arcfile may be a pipe */
+{
+	uint m;
+
+	if (! streaming) {
+		if (fseek(arcfile, (long)n, SEEK_CUR)) error("Can't read");
+		return;
+	}
+	while (n != 0) {
+		m = (uint)((n > DICSIZ) ? DICSIZ : n);
+		if (fread((char *)buffer, 1, m, arcfile) != m) error("Can't read");
+		n -= m;
+	}
 }
 
 static void skip(void)
 {
-	fseek(arcfile, compsize, SEEK_CUR);
+	skip_bytes(compsize);
 }
 
 static void copy(void)
+	/* In big pieces: stdio then moves them straight
+	   between the files and copybuf. */
 {
 	uint n;
 
 	write_header();
 	while (compsize != 0) {
-		n = (uint)((compsize > DICSIZ) ? DICSIZ : compsize);
-		if (fread ((char *)buffer, 1, n, arcfile) != n)
+		n = (uint)((compsize > COPYSIZ) ? COPYSIZ : compsize);
+		if (fread ((char *)copybuf, 1, n, arcfile) != n)
 			error("Can't read");
-		if (fwrite((char *)buffer, 1, n, outfile) != n)
+		if (fwrite((char *)copybuf, 1, n, outfile) != n)
 			error("Can't write");
 		compsize -= n;
 	}
 }
 
-static void store(void)
+static void put_data(uchar *p, uint n)  /* no CRC */
+{
+	if (fwrite((char *)p, 1, n, outfile) != n) error("Can't write");
+}
+
+static void store_rest(void)
+	/* Copy the rest of infile, taking its CRC; origsize is the
+	   number of bytes already stored, whose CRC is in codec->crc. */
 {
 	uint n;
 
-	origsize = 0;
-	crc = INIT_CRC;
 	while ((n = fread((char *)buffer, 1, DICSIZ, infile)) != 0) {
-		fwrite_crc(buffer, n, outfile);  origsize += n;
+		fwrite_crc(codec, buffer, n, outfile);  origsize += n;
 	}
+	check();
 	compsize = origsize;
 }
 
+static void store_late(uint n)
+	/* infile as "-lh0-" after encode() gave it up.  What encode()
+	   has read is written from where it still is: the last of it
+	   in the encoder's text buffer, the first n bytes in inbuf.
+	   Only what is in neither is read again, and no CRC is
+	   taken twice. */
+{
+	ulong done, pos, k;
+	uint m;
+
+	done = codec->origsize;
+	k = (ulong)(codec->textend - codec->textbuf);
+	pos = (done > k) ? done - k : 0;  /* text buffer holds [pos, done) */
+	m = (pos < n) ? (uint)pos : n;
+	put_data(inbuf, m);
+	if (m < pos) {
+		fseek(infile, (long)m, SEEK_SET);
+		for (k = pos - m; k != 0; k -= m) {
+			m = (uint)((k > DICSIZ) ? DICSIZ : k);
+			if (fread((char *)buffer, 1, m, infile) != m)
+				error("Can't read");
+			put_data(buffer, m);
+		}
+		fseek(infile, (long)done, SEEK_SET);
+	}
+	put_data(codec->textend - (uint)(done - pos), (uint)(done - pos));
+	origsize = done;
+	if (done < n) {  /* encode() stopped inside inbuf */
+		fwrite_crc(codec, inbuf + (uint)done, n - (uint)done, outfile);
+		origsize = n;
+	}
+	store_rest();
+}
+
+static void write_segments(void)
+{
+	ulong k;
+
+	fputc(EXT_SEGMENT, outfile);
+	put_bytes(4, segsiz);
+	for (k = 0; k < nsegs; k++) put_bytes(4, segcomp[k]);
+	put_bytes(2, 0);  /* no more extended headers */
+}
+
+static void read_segments(uint size)
+{
+	ulong k;
+
+	if (fgetc(arcfile) != EXT_SEGMENT) error("Bad segment index");
+	segsiz = get_bytes(4);
+	nsegs = (size - 7) / 4;
+	free(segcomp);
+	if ((segcomp = malloc(nsegs * sizeof(ulong))) == NULL)
+		error("Out of memory.");
+	for (k = 0; k < nsegs; k++) segcomp[k] = get_bytes(4);
+}
+
+static ulong store_segment(void)  /* copy up to SEGSIZ bytes */
+{
+	uint n;
+	ulong len;
+
+	len = 0;
+	while (len < SEGSIZ
+	   && (n = fread((char *)buffer, 1, DICSIZ, infile)) != 0) {
+		fwrite_crc(codec, buffer, n, outfile);  len += n;
+	}
+	check();
+	return len;
+}
+
+static void add_segments(uint n, ulong size)
+	/* infile as "-lhs-"; its first n bytes are in inbuf */
+{
+	long headerpos, segpos;
+	ulong k;
+	uint crc, extsize;
+
+	segsiz = SEGSIZ;
+	nsegs = (size + SEGSIZ - 1) / SEGSIZ;
+	free(segcomp);
+	if ((segcomp = malloc(nsegs * sizeof(ulong))) == NULL)
+		error("Out of memory.");
+	extsize = (uint)(7 + 4 * nsegs);
+	header[3] = 's';
+	put_to_header(headersize - 2, 2, extsize);
+	headerpos = ftell(outfile);
+	write_header();  write_segments();  /* temporarily */
+	codec->infile = infile;  codec->outfile = outfile;
+	codec->inptr  = inbuf;   codec->inleft  = n;
+	codec->crc = INIT_CRC;  codec->progress = 0;
+	origsize = 0;  compsize = extsize;
+	for (k = 0; k < nsegs; k++) {
+		segpos = ftell(outfile);  crc = codec->crc;
+		codec->origsize = codec->compsize = 0;  codec->unpackable = 0;
+		codec->readmax = SEGSIZ;  encode(codec);  check();
+		if (codec->unpackable || codec->compsize >= codec->origsize) {
+			/* store it, so that segcomp[k] == size means stored */
+			codec->crc = crc;  codec->inleft = 0;
+			fseek(infile, k * SEGSIZ, SEEK_SET);
+			fseek(outfile, segpos, SEEK_SET);
+			segcomp[k] = store_segment();
+			origsize += segcomp[k];
+		} else {
+			segcomp[k] = codec->compsize;
+			origsize += codec->origsize;
+		}
+		compsize += segcomp[k];
+		putc('.', stderr);
+	}
+	codec->readmax = ULONG_MAX;  codec->progress = 1;
+	file_crc = codec->crc ^ INIT_CRC;
+	put_to_header(5, 4, compsize);
+	put_to_header(9, 4, origsize);
+	segpos = ftell(outfile);  /* end of the file */
+	fseek(outfile, headerpos, SEEK_SET);
+	write_header();  write_segments();  /* true header */
+	fseek(outfile, segpos, SEEK_SET);
+}
+
+static void put_member(uint n, ulong part)
+	/* Compress inbuf[0 .. n-1] into outbuf and write the
+	   member once, with no seeks or second read.  If part is
+	   not 0, the bytes are that far into the file, and an
+	   extended header says so. */
+{
+	long k;
+	uint ext;
+
+	origsize = n;
+	if ((k = ar_encode_chunk(codec, inbuf, n, outbuf, n)) < 0) check();
+	compsize = (ulong)k;
+	if (compsize == 0) {
+		header[3] = '0';  compsize = n;  /* store */
+	}
+	ext = (part != 0) ? 7 : 0;
+	file_crc = codec->crc ^ INIT_CRC;
+	put_to_header(5, 4, compsize + ext);
+	put_to_header(9, 4, origsize);
+	put_to_header(headersize - 2, 2, ext);
+	write_header();
+	if (ext != 0) {
+		fputc(EXT_PART, outfile);  put_bytes(4, part);
+		put_bytes(2, 0);  /* no more extended headers */
+	}
+	if (fwrite((char *)((header[3] == '0') ? inbuf : outbuf),
+			   1, (uint)compsize, outfile) != compsize)
+		error("Can't write");
+	compsize += ext;
+}
+
+static ulong namehash(char *s);
+static void add_entry(ulong hash, long pos);
+
 static int add(int replace_flag)
 {
 	long headerpos, arcpos;
-	uint r;
+	ulong size, orig, comp, h;
+	uint r, n;
 
-	if ((infile = fopen(filename, "rb")) == NULL) {
+	if (readstdin) infile = stdin;
+	else if ((infile = fopen(filename, "rb")) == NULL) {
 		fprintf(stderr, "Can't open %s\n", filename);
 		return 0;  /* failure */
 	}
-	if (replace_flag) {
-        printf("Replacing %-20s ", filename);  skip();
-	} else
-        printf("Adding %-23s ", filename);
-	headerpos = ftell(outfile);
+	if (replace_flag)
+        fprintf(msgfile, "Replacing %-20s ", filename);
+	else
+        fprintf(msgfile, "Adding %-23s ", filename);
 	namelen = strlen(filename);
 	headersize = 25 + namelen;
-	memcpy(header, "-lh5-", 5);  /* compress */
-	write_header();  /* temporarily */
-	arcpos = ftell(outfile);
-	origsize = compsize = 0;  unpackable = 0;
-	crc = INIT_CRC;  encode();
-	if (unpackable) {
-		header[3] = '0';  /* store */
-		rewind(infile);
+	memcpy(header, "-lh5-", 5);  header[3] = lhmethod;  /* compress */
+	memcpy(header + 13, "\0\0\0\0\x20\x01", 6);
+	memcpy(header + headersize - 3, "\x20\0\0", 3);
+	if (streaming || readstdin) {  /* a member for each STREAMSIZ bytes */
+		orig = comp = 0;  h = namehash(filename);
+		n = fread((char *)inbuf, 1, STREAMSIZ, infile);
+		for ( ; ; ) {
+			if (indexing && ! streaming && orig != 0)
+				add_entry(h, ftell(outfile));  /* each part too */
+			put_member(n, orig);  orig += origsize;  comp += compsize;
+			if (n < STREAMSIZ
+			 || (n = fread((char *)inbuf, 1, STREAMSIZ, infile)) == 0) break;
+			header[3] = lhmethod;
+		}
+		origsize = orig;  compsize = comp;
+	} else if ((n = fread((char *)inbuf, 1, MEMBUFSIZ, infile)) < MEMBUFSIZ)
+		put_member(n, 0);  /* whole file is in inbuf */
+	else if (segmented && (fseek(infile, 0L, SEEK_END),
+				 size = ftell(infile), fseek(infile, (long)n, SEEK_SET),
+				 size > SEGSIZ)) {
+		add_segments(n, size);
+	} else {
+		headerpos = ftell(outfile);
+		write_header();  /* temporarily */
+		arcpos = ftell(outfile);
+		codec->infile = infile;  codec->outfile = outfile;
+		codec->inptr  = inbuf;   codec->inleft  = n;
+		codec->origsize = codec->compsize = 0;  codec->unpackable = 0;
+		codec->crc = INIT_CRC;  encode(codec);  check();
+		origsize = codec->origsize;  compsize = codec->compsize;
+		if (codec->unpackable) {
+			header[3] = '0';  /* store */
+			fseek(outfile, arcpos, SEEK_SET);
+			store_late(n);
+		}
+		file_crc = codec->crc ^ INIT_CRC;
+		put_to_header(5, 4, compsize);
+		put_to_header(9, 4, origsize);
+		arcpos = ftell(outfile);  /* end of the file */
+		fseek(outfile, headerpos, SEEK_SET);
+		write_header();  /* true header */
 		fseek(outfile, arcpos, SEEK_SET);
-		store();
 	}
-	file_crc = crc ^ INIT_CRC;
-	fclose(infile);
-	put_to_header(5, 4, compsize);
-	put_to_header(9, 4, origsize);
-    memcpy(header + 13, "\0\0\0\0\x20\x01", 6);
-	memcpy(header + headersize - 3, "\x20\0\0", 3);
-	fseek(outfile, headerpos, SEEK_SET);
-	write_header();  /* true header */
-	fseek(outfile, 0L, SEEK_END);
+	if (infile != stdin) fclose(infile);
 	r = ratio(compsize, origsize);
 //    gotoxy (40, wherey());
-    printf(" %d.%d%%\n", r / 10, r % 10);
+    fprintf(msgfile, " %d.%d%%\n", r / 10, r % 10);
 	return 1;  /* success */
 }
 
+static ulong namehash(char *s)
+{
+	ulong h;
+
+	h = 0;
+	while (*s != '\0') h = (h * 31 + (uchar)*s++) & 0xFFFFFFFFUL;
+	return h;
+}
+
+static void add_entry(ulong hash, long pos)
+{
+	if (nix == ixsize) {
+		ixsize = 2 * ixsize + 64;
+		if ((ixtab = realloc(ixtab, (size_t)ixsize * sizeof(ixentry)))
+			== NULL) error("Out of memory.");
+	}
+	ixtab[nix].hash = hash;  ixtab[nix].pos = pos;  nix++;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	const ixentry *p = a, *q = b;
+
+	if (p->hash != q->hash) return (p->hash < q->hash) ? -1 : 1;
+	return (p->pos < q->pos) ? -1 : (p->pos > q->pos);
+}
+
+static ulong get_entry(ulong k, long *pos)
+	/* Hash and header position of the k-th entry of the
+	   archive's index */
+{
+	ulong h;
+
+	if (ixbase == 0) {  *pos = ixtab[k].pos;  return ixtab[k].hash;  }
+	fseek(arcfile, ixbase + 8 * (long)k, SEEK_SET);
+	h = get_bytes(4);  *pos = (long)get_bytes(4);
+	return h;
+}
+
+static ulong first_entry(ulong h)
+	/* The first entry of the archive's index with hash h or more */
+{
+	ulong lo, hi, mid;
+	long pos;
+
+	lo = 0;  hi = nsorted;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (get_entry(mid, &pos) < h) lo = mid + 1;  else hi = mid;
+	}
+	return lo;
+}
+
+static int read_entry(char *name, long pos)
+	/* Read the header at pos; nonzero if it is name's */
+{
+	fseek(arcfile, pos, SEEK_SET);  read_header();
+	return header[3] != DEAD && strcmp(filename, name) == 0;
+}
+
+static int read_index(void)
+	/* Find the index of arcfile if it has a good one, and set
+	   endpos.  arcfile is left at the start. */
+{
+	long size;
+	ulong n;
+	char tail[4];
+
+	fseek(arcfile, 0L, SEEK_END);  size = ftell(arcfile);
+	if (size >= 1 + INDEXTAIL) {
+		fseek(arcfile, size - INDEXTAIL, SEEK_SET);
+		n = get_bytes(4);  endpos = (long)get_bytes(4);
+		if (fread(tail, 1, 4, arcfile) == 4 && memcmp(tail, "-ix-", 4) == 0
+		 && n <= (ulong)size / 8 && endpos >= 0
+		 && endpos + 1 + 8 * (long)n + INDEXTAIL == size
+		 && fseek(arcfile, endpos, SEEK_SET) == 0 && fgetc(arcfile) == 0) {
+			nsorted = n;  ixbase = endpos + 1;  ixvalid = 1;
+		}
+	}
+	rewind(arcfile);
+	return ixvalid;
+}
+
+static void load_index(void)  /* into ixtab[], to be written anew */
+{
+	ulong k, h;
+
+	fseek(arcfile, ixbase, SEEK_SET);
+	for (nix = 0, k = 0; k < nsorted; k++) {
+		h = get_bytes(4);  add_entry(h, (long)get_bytes(4));
+	}
+	ixbase = 0;
+	rewind(arcfile);
+}
+
+static void write_index(long end)
+	/* After the end mark at end in outfile */
+{
+	ulong k;
+
+	qsort(ixtab, (size_t)nix, sizeof(ixentry), cmp_entry);
+	fseek(outfile, end + 1, SEEK_SET);
+	for (k = 0; k < nix; k++) {
+		put_bytes(4, ixtab[k].hash);  put_bytes(4, (ulong)ixtab[k].pos);
+	}
+	put_bytes(4, nix);  put_bytes(4, (ulong)end);
+	fwrite("-ix-", 1, 4, outfile);
+	if (fflush(outfile) == EOF) error("Can't write");
+}
+
+static void drop_index(void)
+	/* Spoil it, so it is not used if we stop while changing
+	   the archive; write_index() makes it anew. */
+{
+	fseek(arcfile, -4L, SEEK_END);  fputc(0, arcfile);
+	if (fflush(arcfile) == EOF) error("Can't write");
+	ixvalid = 0;
+}
+
+static int append(int replace_flag)
+	/* add() at endpos, in place (outfile == arcfile) */
+{
+	long pos;
+	ulong h;
+
+	if (streaming) return add(replace_flag);  /* no seeks */
+	if (ixvalid) drop_index();
+	h = namehash(filename);  /* add() writes the CRC over its '\0' */
+	pos = commitpos = endpos;
+	fseek(outfile, pos, SEEK_SET);
+	if (! add(replace_flag)) {  commitpos = -1;  return 0;  }
+	commitpos = -1;
+	if (indexing) add_entry(h, pos);
+	endpos = ftell(outfile);
+	fputc(0, outfile);  /* new end of archive */
+	if (fflush(outfile) == EOF) error("Can't write");
+	fseek(outfile, pos, SEEK_SET);
+	fputc(headersize, outfile);  /* now it is there */
+	if (fflush(outfile) == EOF) error("Can't write");
+	return 1;
+}
+
+static void mark_dead(long pos)  /* delete the file whose header is at pos */
+{
+	fseek(arcfile, pos, SEEK_SET);  read_header();
+	header[3] = DEAD;
+	fseek(arcfile, pos, SEEK_SET);  write_header();
+	if (fflush(arcfile) == EOF) error("Can't write");
+}
+
+static void find_end(void)
+	/* endpos, from the index if there is one; with -i the
+	   entries of an index are made on the way */
+{
+	long pos;
+
+	if (read_index()) {  load_index();  indexing = 1;  return;  }
+	while (pos = ftell(arcfile), read_header()) {
+		if (indexing && header[3] != DEAD)
+			add_entry(namehash(filename), pos);
+		skip();
+	}
+	endpos = ftell(arcfile) - 1;
+}
+
 int get_line(char *s, int n)
 {
 	int i, c;
@@ -206,10 +751,31 @@ int get_line(char *s, int n)
 	return i;
 }
 
+static void extract_part(int method, ulong comp, ulong orig)
+{
+	uint n;
+	uchar *p;
+
+	codec->infile = arcfile;  codec->compsize = comp;  codec->inleft = 0;
+	if (method != '0') decode_start(codec);
+	while (orig != 0) {
+		n = (uint)((orig > DICSIZ) ? DICSIZ : orig);
+		if (method != '0') p = decode(codec, n);
+		else if (fread((char *)(p = buffer), 1, n, arcfile) != n)
+			error("Can't read");
+		fwrite_crc(codec, p, n, outfile);  check();
+		if (outfile != stdout) putc('.', stderr);
+		orig -= n;
+	}
+	if (method != '0' && codec->compsize != 0)  /* not read yet */
+		skip_bytes(codec->compsize);
+}
+
 static void extract(int to_file)
 {
-    int n, m, method;
+    int n, m, c, method;
 	uint ext_headersize;
+	ulong k, len, part;
 
     if (to_file == 2)
     {
@@ -229,51 +795,67 @@ static void extract(int to_file)
     }
 
 
+	method = header[3];
+	nsegs = 0;  part = 0;
+	ext_headersize = (uint)get_from_header(headersize - 2, 2);
+	while (ext_headersize != 0) {
+		compsize -= ext_headersize;
+		if (method == 's' && nsegs == 0)
+			read_segments(ext_headersize);
+		else if ((c = fgetc(arcfile)) == EXT_PART && ext_headersize == 7)
+			part = get_bytes(4);  /* goes on from the member before */
+		else {
+			fprintf(stderr, "There's an extended header of size %u.\n",
+				ext_headersize);
+			skip_bytes(ext_headersize - 3);
+		}
+		ext_headersize = fgetc(arcfile);
+		ext_headersize += (uint)fgetc(arcfile) << 8;
+	}
 	if (to_file) {
-		while ((outfile = fopen(filename, "wb")) == NULL) {
+		while ((outfile = fopen(filename, part ? "r+b" : "wb")) == NULL) {
 			fprintf(stderr, "Can't open %s\nNew filename: ", filename);
-			if (get_line(filename, FNAME_MAX) == 0) {
+			if (streaming || part != 0 || get_line(filename, FNAME_MAX) == 0) {
 				fprintf(stderr, "Not extracted\n");
 				skip();  return;
 			}
 			namelen = strlen(filename);
 		}
+		set_buffer(outfile, &filebuf);
+		if (part != 0  /* appended to what the parts before it made */
+		 && (fseek(outfile, 0L, SEEK_END) || ftell(outfile) != (long)part)) {
+			fprintf(stderr, "%s: a part before is missing\nNot extracted\n",
+				filename);
+			fclose(outfile);  skip();  return;
+		}
 		printf("Extracting %s ", filename);
 	} else {
 		outfile = stdout;
-		printf("===== %s =====\n", filename);
+		if (part == 0) fprintf(msgfile, "===== %s =====\n", filename);
 	}
-	crc = INIT_CRC;
-	method = header[3];  header[3] = ' ';
-	if (! strchr("045", method) || memcmp("-lh -", header, 5)) {
+	codec->crc = INIT_CRC;
+	header[3] = ' ';
+	if ((method != '0' && dicbit_of(method) == 0)
+	 || memcmp("-lh -", header, 5)) {
 		fprintf(stderr, "Unknown method: %u\n", method);
 		skip();
 	} else {
-		ext_headersize = (uint)get_from_header(headersize - 2, 2);
-		while (ext_headersize != 0) {
-			fprintf(stderr, "There's an extended header of size %u.\n",
-				ext_headersize);
-			compsize -= ext_headersize;
-			if (fseek(arcfile, ext_headersize - 2, SEEK_CUR))
-				error("Can't read");
-			ext_headersize = fgetc(arcfile);
-			ext_headersize += (uint)fgetc(arcfile) << 8;
+		if (method != '0' && dicbit_of(method) != codec->dicbit) {
+			ar_decoder_free(codec);
+			codec = ar_decoder_create(dicbit_of(method));
+			if (codec == NULL) error("Out of memory.");
 		}
-		crc = INIT_CRC;
-		if (method != '0') decode_start();
-		while (origsize != 0) {
-			n = (uint)((origsize > DICSIZ) ? DICSIZ : origsize);
-			if (method != '0') decode(n, buffer);
-			else if (fread((char *)buffer, 1, n, arcfile) != n)
-				error("Can't read");
-			fwrite_crc(buffer, n, outfile);
-			if (outfile != stdout) putc('.', stderr);
-			origsize -= n;
+		codec->crc = INIT_CRC;
+		if (method != 's') extract_part(method, compsize, origsize);
+		else for (k = 0; k < nsegs; k++) {
+			len = (origsize > segsiz) ? segsiz : origsize;
+			extract_part((segcomp[k] == len) ? '0' : '5', segcomp[k], len);
+			origsize -= len;
 		}
 	}
 	if (to_file) fclose(outfile);  else outfile = NULL;
-	printf("\n");
-	if ((crc ^ INIT_CRC) != file_crc)
+	fprintf(msgfile, "\n");
+	if ((codec->crc ^ INIT_CRC) != file_crc)
 		fprintf(stderr, "CRC error\n");
 }
 
@@ -319,23 +901,309 @@ static int search(int argc, char *argv[])
 	return 0;
 }
 
-static void exitfunc(void)
+static void exitfunc(void)  /* stopped while compacting */
+{
+	if (temp_name == NULL) return;  /* done, or not started */
+	if (outfile != NULL) fclose(outfile);
+	remove(temp_name);
+}
+
+static int compact(char *arcname)
+	/* Copy arcfile to a new archive without the deleted files,
+	   which then takes its place.  Returns the files copied. */
+{
+	int count, err;
+	long pos;
+
+	temp_name = tmpnam(NULL);
+	outfile = fopen(temp_name, "wb");
+	if (outfile == NULL)
+		error("Can't open temporary file");
+	set_buffer(outfile, &filebuf);
+	if (copybuf == NULL && (copybuf = malloc(COPYSIZ)) == NULL)
+		error("Out of memory.");
+	atexit(exitfunc);
+	nix = 0;  /* a new index, if any */
+	rewind(arcfile);  count = 0;
+	while (read_header()) {
+		if (header[3] == DEAD) {  skip();  continue;  }
+		if (indexing) add_entry(namehash(filename), ftell(outfile));
+		copy();  count++;
+	}
+	pos = ftell(outfile);
+	fputc(0, outfile);  /* end of archive */
+	if (indexing) write_index(pos);
+	err = ferror(outfile);
+	if (fclose(outfile) == EOF) err = 1;
+	outfile = NULL;
+	if (err) error("Can't write");
+	fclose(arcfile);  arcfile = NULL;
+	remove(arcname);  rename(temp_name, arcname);
+	temp_name = NULL;
+	return count;
+}
+
+/***** 'B': benchmark *****/
+
+#if UINT_MAX > 0xFFFFU
+	#define BENCHSIZ (1024UL * 1024)  /* bytes of each made-up file */
+#else
+	#define BENCHSIZ (32 * 1024UL)
+#endif
+#define BENCHTIME (CLOCKS_PER_SEC / 4)  /* time each way at least this */
+#define NMETHOD 4  /* '5' .. '8' */
+
+static char *bench_name[] = { "(text)", "(log)", "(binary)", "(random)" };
+static char *bench_word[] = {
+	"the", "of", "and", "to", "a", "in", "is", "it", "that", "for",
+	"file", "archive", "with", "by", "as", "on", "tree", "not", "code",
+	"bytes", "match", "dictionary", "position", "block", "compression",
+	"Huffman", "table", "length", "header", "segment", "buffer", "index"
+};
+static ulong bench_seed;
+static ulong bench_size[NMETHOD][10], bench_pack[NMETHOD][10],
+			 bench_stored[NMETHOD][10];
+static double bench_ctime[NMETHOD][10], bench_dtime[NMETHOD][10];
+static int bench_rows;
+
+static uint bench_rand(uint n)  /* 0 .. n-1, the same on every machine */
+{
+	bench_seed = (bench_seed * 1103515245UL + 12345) & 0xFFFFFFFFUL;
+	return (uint)((bench_seed >> 16) & 0x7FFF) % n;
+}
+
+static void make_data(int kind, uchar *p, ulong n)
+	/* Made-up files: 0 text, 1 log, 2 binary records, 3 random */
+{
+	char line[100];
+	uint i, k;
+	ulong j, t;
+
+	bench_seed = kind + 1;  t = 0;
+	for (j = 0; j < n; ) {
+		switch (kind) {
+		case 0:  /* words, the first ones most often */
+			line[0] = '\0';
+			while (strlen(line) < 60) {
+				k = bench_rand(32);  k = k * bench_rand(32) / 31;
+				strcat(line, bench_word[k]);
+				strcat(line, (bench_rand(8) == 0) ? ". " : " ");
+			}
+			strcat(line, "\n");  break;
+		case 1:
+			t += bench_rand(5);
+			sprintf(line, "1991-%02lu-%02lu %02lu:%02lu:%02lu ar[%u]: %s %s%u.DAT %u bytes\n",
+				t / 2678400 % 12 + 1, t / 86400 % 31 + 1, t / 3600 % 24,
+				t / 60 % 60, t % 60, 200 + bench_rand(20),
+				bench_word[10 + bench_rand(4)], bench_word[20 + bench_rand(12)],
+				bench_rand(100), bench_rand(30000));
+			break;
+		case 2:  /* 16-byte records: a count, small numbers, noise */
+			t++;
+			for (i = 0; i < 4; i++) line[i] = (char)(t >> (8 * i));
+			for (i = 4; i < 12; i++) line[i] = (char)bench_rand(i);
+			for (i = 12; i < 16; i++) line[i] = (char)bench_rand(256);
+			line[16] = '\0';  k = 16;  break;
+		default:
+			for (i = 0; i < 64; i++) line[i] = (char)bench_rand(256);
+			k = 64;  break;
+		}
+		if (kind < 2) k = strlen(line);
+		for (i = 0; i < k && j < n; i++) p[j++] = line[i];
+	}
+}
+
+static double bench_rate(ulong n, double t)  /* MB/s */
+{
+	return (t > 0) ? n / t / 1e6 : 0;
+}
+
+static void bench_row(char *name, int m, int lv, ulong n, ulong pk,
+					  ulong st, double ct, double dt)
+	/* st of the n bytes were stored, so only n - st were expanded */
+{
+	uint r;
+	char *s;
+
+	r = ratio(pk, n);
+	printf("%s  {\"file\": \"", bench_rows++ ? ",\n" : "");
+	for (s = name; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') putchar('\\');
+		putchar(*s);
+	}
+	printf("\", \"method\": \"-lh%c-\", \"level\": %d, \"size\": %lu, "
+		   "\"packed\": %lu, \"stored\": %lu, \"ratio\": %u.%03u, "
+		   "\"compress_mbs\": %.2f, \"expand_mbs\": ",
+		   '5' + m, lv, n, pk, st, r / 1000, r % 1000, bench_rate(n, ct));
+	if (st == n) printf("null}");  /* nothing to time */
+	else printf("%.2f}", bench_rate(n - st, dt));
+}
+
+static void bench_file(char *name, uchar *data, ulong n, uchar *out, uchar *back)
+	/* Each method and level on data[0..n-1], in memory */
+{
+	int m, lv;
+	uint crc;
+	long z;
+	ulong pk, st, k;
+	clock_t t0, t;
+	double ct, dt;
+	ar_state *enc, *dec;
+
+	for (m = 0; m < NMETHOD; m++) {
+		if (lhmethod != 0 && lhmethod != '5' + m) continue;
+		if (dicbit_of('5' + m) == 0) continue;
+		enc = ar_encoder_create(dicbit_of('5' + m));
+		dec = ar_decoder_create(dicbit_of('5' + m));
+		if (enc == NULL || dec == NULL) error("Out of memory.");
+		for (lv = 0; lv <= 9; lv++) {
+			if (level >= 0 && level != lv) continue;
+			ar_encoder_level(enc, lv);
+			k = 0;  t0 = clock();
+			do {
+				if ((z = ar_encode_chunk(enc, data, n, out, n)) < 0)
+					error("%s: %s", name, enc->fault);
+				k++;
+			} while ((t = clock() - t0) < BENCHTIME);
+			pk = (ulong)z;
+			ct = (double)t / CLOCKS_PER_SEC / k;
+			crc = enc->crc ^ INIT_CRC;
+			dt = 0;  st = 0;
+			if (pk == 0) {  /* stored: AR would copy it, not expand it */
+				pk = st = n;
+			} else {
+				k = 0;  t0 = clock();
+				do {
+					z = ar_decode_chunk(dec, out, pk, back, n);
+					if (z != (long)crc)
+						error("%s: %s with -lh%c- -%d", name,
+							(z < 0) ? dec->fault : "CRC error", '5' + m, lv);
+					k++;
+				} while ((t = clock() - t0) < BENCHTIME);
+				dt = (double)t / CLOCKS_PER_SEC / k;
+				if (memcmp(back, data, n) != 0)
+					error("%s: wrong result with -lh%c- -%d", name, '5' + m, lv);
+			}
+			bench_row(name, m, lv, n, pk, st, ct, dt);
+			bench_size[m][lv] += n;  bench_pack[m][lv] += pk;
+			bench_stored[m][lv] += st;
+			bench_ctime[m][lv] += ct;  bench_dtime[m][lv] += dt;
+		}
+		ar_encoder_free(enc);  ar_decoder_free(dec);
+	}
+}
+
+static uchar *bench_read(char *name, ulong *n)
+	/* A whole file, or NULL (if empty, too) */
+{
+	FILE *f;
+	uchar *p;
+	long size;
+
+	if ((f = fopen(name, "rb")) == NULL) {
+		fprintf(stderr, "Can't open %s\n", name);  return NULL;
+	}
+	p = NULL;  size = -1;
+	if (fseek(f, 0L, SEEK_END) == 0 && (size = ftell(f)) > 0
+	 && (size_t)size == size && (p = malloc((size_t)size)) != NULL) {
+		rewind(f);
+		if (fread(p, 1, (size_t)size, f) != (size_t)size) {
+			free(p);  p = NULL;
+		}
+	}
+	fclose(f);
+	if (p == NULL && size != 0) fprintf(stderr, "Can't read %s\n", name);
+	*n = (ulong)size;
+	return p;
+}
+
+static int bench(int argc, char *argv[])
+	/* The files named (or if none, made-up ones) are compressed
+	   and expanded in memory.  Speed, in MB/s of original bytes,
+	   and ratio go to standard output in JSON. */
 {
-	fclose(outfile);  remove(temp_name);
+	int i, m, lv, count;
+	ulong n;
+	uchar *data, *out, *back;
+	char name[FNAME_MAX + 1], *s;
+	struct ffblk ff;
+
+	if (lhmethod != 0 && dicbit_of(lhmethod) == 0) error(usage);
+	make_crctable();  count = 0;
+	printf("[\n");
+	if (argc == 0) {
+		data = malloc(BENCHSIZ);  out = malloc(BENCHSIZ);
+		back = malloc(BENCHSIZ);
+		if (data == NULL || out == NULL || back == NULL)
+			error("Out of memory.");
+		for (i = 0; i < 4; i++) {
+			make_data(i, data, BENCHSIZ);
+			bench_file(bench_name[i], data, BENCHSIZ, out, back);
+			count++;
+		}
+		free(data);  free(out);  free(back);
+	}
+	for (i = 0; i < argc; i++) {
+		if (findfirst(argv[i], &ff, 0)) {
+			fprintf(stderr, "Can't open %s\n", argv[i]);  continue;
+		}
+		strncpy(name, argv[i], FNAME_MAX);  name[FNAME_MAX] = '\0';
+		if ((s = strrchr(name, '\\')) == NULL) s = strrchr(name, '/');
+		s = (s == NULL) ? name : s + 1;  /* the path stays */
+		do {
+			strncpy(s, ff.ff_name, FNAME_MAX - (s - name));
+			if ((data = bench_read(name, &n)) == NULL) continue;
+			out = malloc((size_t)n);  back = malloc((size_t)n);
+			if (out == NULL || back == NULL) error("Out of memory.");
+			bench_file(name, data, n, out, back);
+			free(data);  free(out);  free(back);  count++;
+		} while (! findnext(&ff));
+	}
+	if (count > 1)  /* all together */
+		for (m = 0; m < NMETHOD; m++)
+			for (lv = 0; lv <= 9; lv++)
+				if (bench_size[m][lv] != 0)
+					bench_row("*", m, lv, bench_size[m][lv],
+						bench_pack[m][lv], bench_stored[m][lv],
+						bench_ctime[m][lv], bench_dtime[m][lv]);
+	printf("\n]\n");
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
 {
-	int i, j, cmd, count, nfiles, found, done;
-    char arcname[12];
+	int i, j, cmd, count, nfiles, found, done, created, dead, same;
+	long pos, next, oldend;
+	ulong k, h;
+    char arcname[12], lastname[FNAME_MAX + 1];
     struct ffblk *foundfile;
 
 	/* Check command line arguments. */
-	if (argc < 3
+	if (argc < 2
 	 || argv[1][1] != '\0'
-     || ! strchr("AEXRDPL", cmd = toupper(argv[1][0]))
-	 || (argc == 3 && strchr("AD", cmd)))
+     || ! strchr("AEXRDPLCB", cmd = toupper(argv[1][0]))
+	 || (argc < 3 && cmd != 'B'))
 		error(usage);
+	if (cmd == 'B') {  lhmethod = 0;  level = -1;  }  /* all of them */
+
+	/* Switches come between command and archive name. */
+	while (argc > 3 - (cmd == 'B') && argv[2][0] == '-' && argv[2][1] != '\0') {
+		switch (toupper(argv[2][1])) {
+		case 'S':  segmented = 1;  break;
+		case 'I':  indexing = 1;  break;
+		case 'M':  marking = 1;  break;
+		case 'O':  lhmethod = argv[2][2];  break;
+		case '1':  case '2':  case '3':  case '4':  case '5':
+		case '6':  case '7':  case '8':  case '9':
+			level = argv[2][1] - '0';  break;
+		default:   error(usage);
+		}
+		argv[2] = argv[1];  argv++;  argc--;
+	}
+	if (cmd == 'B') return bench(argc - 2, argv + 2);  /* no archive */
+	if (argc == 3 && strchr("AD", cmd)) error(usage);
+	if (! strchr("5678", lhmethod) || dicbit_of(lhmethod) == 0
+	 || (segmented && lhmethod != '5')) error(usage);
 
 	/* Wildcards used? */
     for (i = 3; i < argc; i++)
@@ -362,21 +1230,49 @@ int main(int argc, char *argv[])
     if (!j)
         strcat(arcname, ".AR");
 
-    /* Open archive. */
-    arcfile = fopen(arcname, "rb");
-	if (arcfile == NULL && cmd != 'A')
+    /* Open archive.  'A', 'R' and 'D' write to it in place. */
+	created = 0;  msgfile = stdout;
+	if (strcmp(argv[2], "-") == 0) {  /* a pipe */
+		streaming = 1;  nfiles = -1;  /* read the pipe to its end */
+		if (cmd == 'A') {  outfile = stdout;  msgfile = stderr;  }
+		else if (strchr("EXPL", cmd)) arcfile = stdin;
+		else error(usage);
+		set_buffer((cmd == 'A') ? stdout : stdin, &arcbuf);
+		if (cmd == 'P') msgfile = stderr;
+	} else if (strchr("ARD", cmd)) {
+		arcfile = fopen(arcname, "r+b");
+		if (arcfile != NULL) {
+			set_buffer(arcfile, &arcbuf);  find_end();
+		} else if (cmd == 'A' && (arcfile = fopen(arcname, "w+b")) != NULL) {
+			set_buffer(arcfile, &arcbuf);
+			fputc(0, arcfile);  endpos = 0;  created = 1;
+		}
+		outfile = arcfile;
+	} else if ((arcfile = fopen(arcname, "rb")) != NULL) {
+		set_buffer(arcfile, &arcbuf);
+		if ((cmd == 'C' || nfiles > 0) && read_index()) indexing = 1;
+	}
+	if (arcfile == NULL && ! (streaming && cmd == 'A'))
         error("Can't open archive '%s'", arcname);
+	oldend = endpos;
 
-	/* Open temporary file. */
-	if (strchr("ARD", cmd)) {
-		temp_name = tmpnam(NULL);
-		outfile = fopen(temp_name, "wb");
-		if (outfile == NULL)
-			error("Can't open temporary file");
-		atexit(exitfunc);
-	} else temp_name = NULL;
-
-	make_crctable();  count = done = 0;
+	if (strchr("AR", cmd)) {
+		k = streaming ? STREAMSIZ : MEMBUFSIZ;
+		for (i = 3; i < argc; i++)  /* standard input is added in parts */
+			if (cmd == 'A' && strcmp(argv[i], "-") == 0) {
+				argv[i] = stdinname;  k = STREAMSIZ;
+			}
+		codec  = ar_encoder_create(dicbit_of(lhmethod));
+		inbuf  = malloc((size_t)k);
+		outbuf = malloc((size_t)k);
+		if (codec == NULL || inbuf == NULL || outbuf == NULL)
+			error("Out of memory.");
+		ar_encoder_level(codec, level);
+	} else codec = ar_decoder_create(DICBIT);
+	if (codec == NULL) error("Out of memory.");
+	codec->progress = 1;
+	make_crctable();  count = done = dead = 0;
+	if (cmd == 'C') {  count = compact(arcname);  done = 1;  }
 
 	if (cmd == 'A') {
 		for (i = 3; i < argc; i++) {
@@ -393,57 +1289,116 @@ int main(int argc, char *argv[])
                     path[l]=toupper(argv[i][l]);
                 path[l]=0;
 
+                if (argv[i] == stdinname) {  /* its old copies go too */
+                    strcpy(filename, stdinname);  readstdin = 1;
+                    if (append(0)) count++;  else argv[i][0] = 0;
+                    readstdin = 0;  continue;
+                }
                 findfirst (argv[i], foundfile, 0);
                 strcpy(filename, path);
                 strcat(filename, foundfile->ff_name);
-                if (add(0)) count++;  else argv[i][0] = 0;
+                if (append(0)) count++;  else argv[i][0] = 0;
                 while (!findnext(foundfile))
                 {
                     strcpy(filename, path);
                     strcat(filename, foundfile->ff_name);
-                    if (add(0)) count++;  else argv[i][0] = 0;
+                    if (append(0)) count++;  else argv[i][0] = 0;
                 }
             } else nfiles--;
 		}
-		if (count == 0 || arcfile == NULL) done = 1;
+		if (count == 0) done = 1;
+	}
+
+	/* 'A', 'R' and 'D' go through the files that were there
+	   before.  Old copies are deleted once new ones are in. */
+	if (strchr("ARD", cmd) && nfiles > 0 && nsorted != 0) {
+		/* Named files are looked up in the index.  The parts
+		   of a file follow it there, and go with it. */
+		for (i = 3; ! done && i < argc; i++) {
+			found = -1;
+			for (h = namehash(argv[i]), k = first_entry(h);
+				 k < nsorted && get_entry(k, &pos) == h; k++)
+				if (read_entry(argv[i], pos)) {
+					if (found < 0) found = (cmd != 'R' || append(1));
+					if (found) {  mark_dead(pos);  dead++;  }
+				}
+			count += (found > 0 && cmd != 'A');
+		}
+		done = 1;
+	} else if (strchr("ARD", cmd)) {
+		lastname[0] = '\0';  found = 0;
+		for (pos = 0; ! done && pos < oldend; pos = next) {
+			fseek(arcfile, pos, SEEK_SET);  read_header();
+			next = ftell(arcfile) + compsize;
+			if (header[3] == DEAD) continue;
+			same = (strcmp(filename, lastname) == 0);  /* a part of it */
+			strcpy(lastname, filename);  /* before add() spoils it */
+			if (! same) found = search(argc, argv)
+							 && (cmd != 'R' || append(1));
+			if (found) {
+				mark_dead(pos);  dead++;  count += (cmd != 'A' && ! same);
+			}
+		}
+		done = 1;
+	} else if (nfiles > 0 && ixvalid && cmd != 'C') {
+		for (i = 3; i < argc; i++) {
+			for (j = 3; j < i; j++)
+				if (strcmp(argv[j], argv[i]) == 0) break;
+			if (j < i) continue;
+			found = 0;
+			for (h = namehash(argv[i]), k = first_entry(h);
+				 k < nsorted && get_entry(k, &pos) == h; k++) {
+				if (! read_entry(argv[i], pos)) continue;
+				if (cmd == 'L') {
+					if (count == 0 && ! found) list_start();
+					list();
+				} else extract((cmd == 'X') + 2*(cmd == 'E'));
+				found = 1;
+			}
+			count += found;
+		}
+		done = 1;
 	}
 
+	lastname[0] = '\0';
 	while (! done && read_header()) {
+		if (header[3] == DEAD) {  skip();  continue;  }
+		same = (strcmp(filename, lastname) == 0);  /* a part of it */
+		strcpy(lastname, filename);
+		if (nfiles > 0 && count == nfiles && ! same) break;  /* all found */
 		found = search(argc, argv);
 		switch (cmd) {
-		case 'R':
-			if (found) {
-				if (add(1)) count++;  else copy();
-			} else copy();
-			break;
-		case 'A':  case 'D':
-			if (found) {
-				count += (cmd == 'D');  skip();
-			} else copy();
-			break;
         case 'X':  case 'P':  case 'E':
 			if (found) {
                 extract((cmd == 'X') + 2*(cmd == 'E'));
-				if (++count == nfiles) done = 1;
+				count += ! same;
 			} else skip();
 			break;
 		case 'L':
 			if (found) {
 				if (count == 0) list_start();
 				list();
-				if (++count == nfiles) done = 1;
+				count += ! same;
 			}
 			skip();  break;
 		}
 	}
 
-	if (temp_name != NULL && count != 0) {
+	if (streaming && cmd == 'A') {
 		fputc(0, outfile);  /* end of archive */
-		if (ferror(outfile) || fclose(outfile) == EOF)
+		if (fflush(outfile) == EOF) error("Can't write");
+	} else if (strchr("ARD", cmd)) {
+		if (fflush(arcfile) == EOF || ferror(arcfile))
 			error("Can't write");
-        remove(arcname);  rename(temp_name, arcname);
+		if (dead != 0 && ! marking)  /* no "-lh!-" left for others */
+			compact(arcname);
+		else {
+			if (indexing && ! ixvalid) write_index(endpos);
+			if (fclose(arcfile) == EOF) error("Can't write");
+		}
+		if (created && count == 0) remove(arcname);
 	}
 
-	printf("  %d files\n", count);
+	fprintf(msgfile, "  %d files\n", count);
 	return EXIT_SUCCESS;
 }
@@ -8,41 +8,23 @@ typedef unsigned int   uint;    /* 16 bits or more */
 typedef unsigned short ushort;  /* 16 bits or more */
 typedef unsigned long  ulong;   /* 32 bits or more */
 
-/* ar.c */
-
-extern int unpackable;
-extern ulong origsize, compsize;
-
-/* io.c */
-
-#define INIT_CRC  0  /* CCITT: 0xFFFF */
-extern FILE *arcfile, *infile, *outfile;
-extern uint crc, bitbuf;
-#define BITBUFSIZ (CHAR_BIT * sizeof bitbuf)
-
-void error(char *fmt, ...);
-void make_crctable(void);
-void fillbuf(int n);
-uint getbits(int n);
-/* void putbit(int bit); */
-void putbits(int n, uint x);
-int fread_crc(uchar *p, int n, FILE *f);
-void fwrite_crc(uchar *p, int n, FILE *f);
-void init_getbits(void);
-void init_putbits(void);
-
 /* encode.c and decode.c */
 
-#define DICBIT    13    /* 12(-lh4-) or 13(-lh5-) */
+#define DICBIT    13    /* default: 13(-lh5-); 15(-lh6-) 16(-lh7-) 17(-lh8-) */
 #define DICSIZ (1U << DICBIT)
 #define MATCHBIT   8    /* bits for MAXMATCH - THRESHOLD */
 #define MAXMATCH 256    /* formerly F (not more than UCHAR_MAX + 1) */
 #define THRESHOLD  3    /* choose optimal value */
-#define PERC_FLAG 0x8000U
 
-void encode(void);
-void decode_start(void);
-void decode(uint count, uchar text[]);
+#if UINT_MAX > 0xFFFFU
+	#define MAXDICBIT 17  /* largest dictionary: -lh8- */
+	typedef int node;
+	#define PERC_FLAG 0x80000000U
+#else  /* 16-bit int: no dictionary bigger than -lh5-'s */
+	#define MAXDICBIT 13
+	typedef short node;
+	#define PERC_FLAG 0x8000U
+#endif
 
 /* huf.c */
 
@@ -50,22 +32,135 @@ void decode(uint count, uchar text[]);
 	/* alphabet = {0, 1, 2, ..., NC - 1} */
 #define CBIT 9  /* $\lfloor \log_2 NC \rfloor + 1$ */
 #define CODE_BIT  16  /* codeword length */
+#define MAXNP (MAXDICBIT + 1)  /* s->np = s->dicbit + 1 */
+	/* s->pbit: smallest integer such that (1U << s->pbit) > s->np */
+#define NT (CODE_BIT + 3)
+#define TBIT 5  /* smallest integer such that (1U << TBIT) > NT */
+#if NT > MAXNP
+	#define NPT NT
+#else
+	#define NPT MAXNP
+#endif
+
+/* Decoding table: 1U << tb entries, then up to n / 2
+   second-level tables of 1U << (16 - tb) entries */
+#define TABLESIZ(n, tb) ((1U << (tb)) + (n) / 2 * (1U << (16 - (tb))))
+
+/* The whole state of one compression or decompression
+   stream.  Nothing in it is shared with another ar_state,
+   so several streams may run at once (one per thread). */
+
+typedef struct ar_state {
+	int   dicbit, np, pbit;  /* fixed when the state is created */
+	uint  dicsiz;
+	/* io.c */
+	FILE  *infile, *outfile;  /* after inptr/outptr, or NULL */
+	uchar *inptr, *outptr, *iobuf;
+	ulong inleft, outleft;
+	ulong origsize, compsize;
+	ulong readmax;  /* encoder input ends when origsize gets here */
+	int   unpackable;
+	char  *fault;  /* why the stream could not go on, or NULL */
+	uint  crc;
+	ulong bitbuf;
+	int   bitcount;
+	int   progress;  /* print a dot per dicsiz bytes read */
+	/* encode.c */
+	uchar *textbuf, *text, *textend;  /* text[] moves on in textbuf[] */
+	uchar *childcount;
+	node  pos, matchpos, avail, *position, *parent, *prev, *next;
+	int   remainder, matchlen, numper;
+	int   chainmax, lazy, nice, hshift;  /* hash chains, if chainmax */
+	int   optimal;  /* binary trees and optimal parsing */
+	void  *opt;     /* its work area */
+	#if MAXMATCH <= (UCHAR_MAX + 1)
+		uchar *level;
+	#else
+		ushort *level;
+	#endif
+	/* decode.c */
+	uchar *window;  /* WINSIZ(s) bytes */
+	uint  wpos, rpos;  /* decoded up to here, returned up to here */
+	/* huf.c */
+	ushort *tok_c;  /* the block: chars and length codes, */
+	uint   *tok_p;  /* and a position for each length */
+	uint   maxtok, ntok, nmatch, ccount, pcount;  /* counted so far */
+	uchar  c_len[NC], pt_len[NPT];
+	uint   blocksize, tokenmax;
+	ushort c_freq[2 * NC - 1], c_table[TABLESIZ(NC, 12)], c_code[NC],
+		   p_freq[2 * MAXNP - 1], pt_table[TABLESIZ(NPT, 8)], pt_code[NPT],
+		   t_freq[2 * NT - 1];
+	int    split;  /* blocks end where it pays (else at 16K bytes) */
+	uint   segtok, segmatch;  /* the last point where it might have */
+	ulong  b_bits;  /* block_bits() of the tokens before segtok */
+	ushort b_c_freq[2 * NC - 1], b_p_freq[2 * MAXNP - 1],  /* before it */
+		   e_c_freq[2 * NC - 1], e_p_freq[2 * MAXNP - 1];  /* estimates */
+	uchar  e_c_len[NC], e_pt_len[NPT];
+	ushort e_code[NC];
+	/* maketree.c */
+	ushort sym[NC], tmp[NC], len_cnt[17];  /* symbols by count */
+	ulong  list[2][2 * NC - 2];  /* counts; package-merge lists */
+} ar_state;
+
+/* io.c */
+
+#define INIT_CRC  0  /* CCITT: 0xFFFF */
+#define BITBUFSIZ (CHAR_BIT * sizeof(ulong))  /* bits in bitbuf */
+#define PUTMAX (BITBUFSIZ - CHAR_BIT + 1)  /* most bits one putbits() takes */
+#define IOBUFSIZ  (2 * DICSIZ)  /* infile or outfile goes by this much */
+
+void fail(ar_state *s, char *why);
+void make_crctable(void);  /* once, before any stream is run */
+void update_crc(ar_state *s, uchar *p, ulong n);
+void fillbuf(ar_state *s, int n);
+uint getbits(ar_state *s, int n);
+/* void putbit(ar_state *s, int bit); */
+void putbits(ar_state *s, int n, ulong x);
+void flush_putbits(ar_state *s);
+int fread_crc(ar_state *s, uchar *p, int n, FILE *f);
+void fwrite_crc(ar_state *s, uchar *p, int n, FILE *f);
+void init_getbits(ar_state *s);
+void init_putbits(ar_state *s);
+
+/* encode.c */
+
+ar_state *ar_encoder_create(int dicbit);
+void ar_encoder_free(ar_state *s);
+long ar_encode_chunk(ar_state *s, uchar *in, ulong insize,
+					 uchar *out, ulong outsize);
+void ar_encoder_level(ar_state *s, int level);
+void encode(ar_state *s);
+
+/* decode.c */
+
+#define WINSIZ(s) (4 * (s)->dicsiz + MAXMATCH)  /* history + output + slack */
+
+ar_state *ar_decoder_create(int dicbit);
+void ar_decoder_free(ar_state *s);
+long ar_decode_chunk(ar_state *s, uchar *in, ulong insize,
+					 uchar *out, ulong outsize);
+void decode_start(ar_state *s);
+uchar *decode(ar_state *s, uint count);
+
+/* huf.c */
 
-extern ushort left[], right[];
+extern const uchar nbit_tab[256];  /* bits in 0 .. 255, 0 for 0 */
+#define NBITS(p) (((p) < 0x100) ? nbit_tab[p] \
+	: ((p) < 0x10000L) ? nbit_tab[(p) >> 8] + 8 \
+	: nbit_tab[(ulong)(p) >> 16] + 16)  /* p < 1UL << 24 */
 
-void huf_encode_start(void);
-void huf_decode_start(void);
-uint decode_c(void);
-uint decode_p(void);
-void output(uint c, uint p);
-void huf_encode_end(void);
+void huf_encode_start(ar_state *s);
+void huf_decode_start(ar_state *s);
+uint decode_c(ar_state *s);
+uint decode_p(ar_state *s);
+void output(ar_state *s, uint c, uint p);
+void huf_encode_end(ar_state *s);
 
 /* maketbl.c */
 
-void make_table(int nchar, uchar bitlen[],
-				int tablebits, ushort table[]);
+int make_table(int nchar, uchar bitlen[], int tablebits, ushort table[]);
 
 /* maketree.c */
 
-int make_tree(int nparm, ushort freqparm[],
+int make_tree(ar_state *s, int nparm, ushort freqparm[],
 				uchar lenparm[], ushort codeparm[]);
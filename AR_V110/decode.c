@@ -2,46 +2,107 @@
 	decode.c
 ***********************************************************/
 #include "ar.h"
+#include <stdlib.h>
+#include <string.h>  /* memcpy(), memmove() */
 
-static int j;  /* remaining bytes to copy */
+ar_state *ar_decoder_create(int dicbit)
+	/* Dictionary of 1U << dicbit bytes (DICBIT .. MAXDICBIT).
+	   NULL if out of memory */
+{
+	ar_state *s;
+
+	if ((s = calloc(1, sizeof(ar_state))) == NULL) return NULL;
+	s->dicbit = dicbit;  s->dicsiz = 1U << dicbit;
+	s->np = dicbit + 1;  s->pbit = (s->np < 16) ? 4 : 5;
+	s->window = malloc(WINSIZ(s));
+	s->iobuf  = malloc(IOBUFSIZ);
+	if (s->window == NULL || s->iobuf == NULL) {
+		ar_decoder_free(s);  return NULL;
+	}
+	s->readmax = ULONG_MAX;
+	return s;
+}
+
+void ar_decoder_free(ar_state *s)
+{
+	free(s->window);  free(s->iobuf);  free(s);
+}
 
-void decode_start(void)
+long ar_decode_chunk(ar_state *s, uchar *in, ulong insize,
+					 uchar *out, ulong outsize)
+	/* Decompress insize bytes in[] into exactly outsize
+	   bytes out[].  Returns the CRC of out[], or -1 if in[]
+	   is bad; s->fault says why. */
 {
-	huf_decode_start();
-	j = 0;
+	uint n;
+	uchar *p;
+
+	s->infile = s->outfile = NULL;
+	s->inptr  = in;   s->inleft  = insize;  s->compsize = 0;
+	s->outptr = out;  s->outleft  = outsize;
+	s->fault = NULL;
+	s->crc = INIT_CRC;  decode_start(s);
+	while (outsize != 0) {
+		n = (uint)((outsize > s->dicsiz) ? s->dicsiz : outsize);
+		p = decode(s, n);
+		if (s->fault != NULL) return -1;
+		fwrite_crc(s, p, n, NULL);
+		outsize -= n;
+	}
+	return (long)(s->crc ^ INIT_CRC);
 }
 
-void decode(uint count, uchar buffer[])
-	/* The calling function must keep the number of
-	   bytes to be processed.  This function decodes
-	   either 'count' bytes or 'DICSIZ' bytes, whichever
-	   is smaller, into the array 'buffer[]' of size
-	   'DICSIZ' or more.
+void decode_start(ar_state *s)
+{
+	huf_decode_start(s);
+	s->wpos = s->rpos = s->dicsiz;
+}
+
+static void copy_match(uchar *p, uint d, uint len)
+	/* p[0 .. len-1] = p[-d .. -d+len-1], overlapping or not */
+{
+	uchar *q;
+
+	q = p - d;
+	if (len <= 2 * sizeof(ulong)) {  /* short: not worth a call */
+		while (len-- != 0) *p++ = *q++;
+		return;
+	}
+	while (d < len) {  /* the pattern doubles each time */
+		memcpy(p, q, d);  p += d;  len -= d;  d += d;
+	}
+	memcpy(p, q, len);
+}
+
+uchar *decode(ar_state *s, uint count)
+	/* Returns a pointer to the next 'count' (at most
+	   s->dicsiz) bytes of output, valid until the next call.
+	   Output is decoded a whole match at a time into
+	   s->window, after dicsiz bytes of history; what goes
+	   past 'count' is kept for the next call.
 	   Call decode_start() once for each new file
 	   before calling this function. */
 {
-	static uint i;
-	uint r, c;
-
-	r = 0;
-	while (--j >= 0) {
-		buffer[r] = buffer[i];
-		i = (i + 1) & (DICSIZ - 1);
-		if (++r == count) return;
+	uint c, len, d;
+	uchar *w, *p, *end;
+
+	w = s->window;
+	if (s->wpos + count + MAXMATCH > WINSIZ(s)) {  /* slide */
+		d = s->wpos - s->dicsiz;
+		memmove(w, w + d, s->dicsiz);
+		s->wpos -= d;  s->rpos -= d;
 	}
-	for ( ; ; ) {
-		c = decode_c();
-		if (c <= UCHAR_MAX) {
-			buffer[r] = c;
-			if (++r == count) return;
-		} else {
-			j = c - (UCHAR_MAX + 1 - THRESHOLD);
-			i = (r - decode_p() - 1) & (DICSIZ - 1);
-			while (--j >= 0) {
-				buffer[r] = buffer[i];
-				i = (i + 1) & (DICSIZ - 1);
-				if (++r == count) return;
-			}
+	p = w + s->wpos;  end = w + s->rpos + count;
+	while (p < end) {
+		c = decode_c(s);
+		if (c <= UCHAR_MAX) *p++ = c;
+		else {
+			len = c - (UCHAR_MAX + 1 - THRESHOLD);
+			d = decode_p(s) + 1;
+			copy_match(p, d, len);  p += len;
 		}
 	}
+	s->wpos = (uint)(p - w);
+	p = w + s->rpos;  s->rpos += count;
+	return p;
 }
@@ -7,236 +7,574 @@
 
 #define PERCOLATE  1
 #define NIL        0
-#define MAX_HASH_VAL (3 * DICSIZ + (DICSIZ / 512 + 1) * UCHAR_MAX)
-
-typedef short node;
-
-static uchar *text, *childcount;
-static node pos, matchpos, avail,
-	*position, *parent, *prev, *next = NULL;
-static int remainder, matchlen;
-
-#if MAXMATCH <= (UCHAR_MAX + 1)
-	static uchar *level;
+#define MAX_HASH_VAL (3 * s->dicsiz + (s->dicsiz / 512 + 1) * UCHAR_MAX)
+#if UINT_MAX > 0xFFFFU
+	#define READK 32  /* input is read READK * dicsiz at a time */
 #else
-	static ushort *level;
+	#define READK  2
 #endif
+#define TEXTSIZ (s->dicsiz * (2 + READK) + MAXMATCH)  /* textbuf[] */
 
-int numper;
-
-static void allocate_memory(void)
+ar_state *ar_encoder_create(int dicbit)
+	/* Dictionary of 1U << dicbit bytes (DICBIT .. MAXDICBIT).
+	   NULL if out of memory */
 {
-	if (next != NULL) return;
-    text = malloc(DICSIZ * 2 + MAXMATCH);
-	level      = malloc((DICSIZ + UCHAR_MAX + 1) * sizeof(*level));
-	childcount = malloc((DICSIZ + UCHAR_MAX + 1) * sizeof(*childcount));
+	ar_state *s;
+
+	if ((s = calloc(1, sizeof(ar_state))) == NULL) return NULL;
+	s->dicbit = dicbit;  s->dicsiz = 1U << dicbit;
+	s->np = dicbit + 1;  s->pbit = (s->np < 16) ? 4 : 5;
+	s->textbuf    = calloc(TEXTSIZ, 1);
+	s->level      = malloc((s->dicsiz + UCHAR_MAX + 1)
+							* sizeof(*s->level));
+	s->childcount = malloc((s->dicsiz + UCHAR_MAX + 1)
+							* sizeof(*s->childcount));
 	#if PERCOLATE
-	  position = malloc((DICSIZ + UCHAR_MAX + 1) * sizeof(*position));
+	  s->position = malloc((s->dicsiz + UCHAR_MAX + 1)
+							* sizeof(*s->position));
 	#else
-	  position = malloc(DICSIZ * sizeof(*position));
+	  s->position = malloc(s->dicsiz * sizeof(*s->position));
 	#endif
-	parent     = malloc(DICSIZ * 2 * sizeof(*parent));
-	prev       = malloc(DICSIZ * 2 * sizeof(*prev));
-	next       = malloc((MAX_HASH_VAL + 1) * sizeof(*next));
-	if (next == NULL) error("Out of memory.");
+	s->parent     = malloc(s->dicsiz * 2 * sizeof(*s->parent));
+	s->prev       = malloc(s->dicsiz * 2 * sizeof(*s->prev));
+	s->next       = malloc((MAX_HASH_VAL + 1) * sizeof(*s->next));
+	s->iobuf      = malloc(IOBUFSIZ);
+	if (s->textbuf == NULL || s->level == NULL || s->childcount == NULL
+	 || s->position == NULL || s->parent == NULL || s->prev == NULL
+	 || s->next == NULL || s->iobuf == NULL) {
+		ar_encoder_free(s);  return NULL;
+	}
+	s->readmax = ULONG_MAX;
+	return s;
+}
+
+void ar_encoder_free(ar_state *s)
+{
+	free(s->textbuf);  free(s->level);  free(s->childcount);
+	free(s->position);  free(s->parent);  free(s->prev);
+	free(s->next);  free(s->opt);  free(s->iobuf);
+	free(s->tok_c);  free(s->tok_p);  free(s);
+}
+
+long ar_encode_chunk(ar_state *s, uchar *in, ulong insize,
+					 uchar *out, ulong outsize)
+	/* Compress in[0..insize-1] into out[0..outsize-1].
+	   Returns the compressed size, or 0 if the chunk did
+	   not get smaller (store it instead).  Either way
+	   s->crc ^ INIT_CRC is the CRC of in[].  -1 if it
+	   could not be done; s->fault says why. */
+{
+	s->infile = s->outfile = NULL;
+	s->inptr  = in;   s->inleft  = insize;
+	s->outptr = out;  s->outleft = outsize;
+	s->origsize = s->compsize = 0;  s->unpackable = 0;
+	s->fault = NULL;
+	s->crc = INIT_CRC;  encode(s);
+	if (s->fault != NULL) return -1;
+	if (! s->unpackable) return (long)s->compsize;
+	s->crc = INIT_CRC;  update_crc(s, in, insize);
+	return 0;
 }
 
-static void init_slide(void)
+static void init_slide(ar_state *s)
 {
 	node i;
 
-	for (i = DICSIZ; i <= DICSIZ + UCHAR_MAX; i++) {
-		level[i] = 1;
+	for (i = s->dicsiz; i <= s->dicsiz + UCHAR_MAX; i++) {
+		s->level[i] = 1;
 		#if PERCOLATE
-			position[i] = NIL;  /* sentinel */
+			s->position[i] = NIL;  /* sentinel */
 		#endif
 	}
-	for (i = DICSIZ; i < DICSIZ * 2; i++) parent[i] = NIL;
-	avail = 1;
-	for (i = 1; i < DICSIZ - 1; i++) next[i] = i + 1;
-	next[DICSIZ - 1] = NIL;
-	for (i = DICSIZ * 2; i <= MAX_HASH_VAL; i++) next[i] = NIL;
+	for (i = s->dicsiz; i < s->dicsiz * 2; i++) s->parent[i] = NIL;
+	s->avail = 1;
+	for (i = 1; i < s->dicsiz - 1; i++) s->next[i] = i + 1;
+	s->next[s->dicsiz - 1] = NIL;
+	for (i = s->dicsiz * 2; i <= MAX_HASH_VAL; i++) s->next[i] = NIL;
 }
 
-#define HASH(p, c) ((p) + ((c) << (DICBIT - 9)) + DICSIZ * 2)
+#define HASH(p, c) ((p) + ((c) << (s->dicbit - 9)) + s->dicsiz * 2)
 
-static node child(node q, uchar c)
+static node child(ar_state *s, node q, uchar c)
 	/* q's child for character c (NIL if not found) */
 {
 	node r;
 
-	r = next[HASH(q, c)];
-	parent[NIL] = q;  /* sentinel */
-	while (parent[r] != q) r = next[r];
+	r = s->next[HASH(q, c)];
+	s->parent[NIL] = q;  /* sentinel */
+	while (s->parent[r] != q) r = s->next[r];
 	return r;
 }
 
-static void makechild(node q, uchar c, node r)
+static void makechild(ar_state *s, node q, uchar c, node r)
 	/* Let r be q's child for character c. */
 {
 	node h, t;
 
 	h = HASH(q, c);
-	t = next[h];  next[h] = r;  next[r] = t;
-	prev[t] = r;  prev[r] = h;
-	parent[r] = q;  childcount[q]++;
+	t = s->next[h];  s->next[h] = r;  s->next[r] = t;
+	s->prev[t] = r;  s->prev[r] = h;
+	s->parent[r] = q;  s->childcount[q]++;
 }
 
-void split(node old)
+static void split(ar_state *s, node old)
 {
 	node new, t;
 
-	new = avail;  avail = next[new];  childcount[new] = 0;
-	t = prev[old];  prev[new] = t;  next[t] = new;
-	t = next[old];  next[new] = t;  prev[t] = new;
-	parent[new] = parent[old];
-	level[new] = matchlen;
-	position[new] = pos;
-	makechild(new, text[matchpos + matchlen], old);
-	makechild(new, text[pos + matchlen], pos);
+	new = s->avail;  s->avail = s->next[new];  s->childcount[new] = 0;
+	t = s->prev[old];  s->prev[new] = t;  s->next[t] = new;
+	t = s->next[old];  s->next[new] = t;  s->prev[t] = new;
+	s->parent[new] = s->parent[old];
+	s->level[new] = s->matchlen;
+	s->position[new] = s->pos;
+	makechild(s, new, s->text[s->matchpos + s->matchlen], old);
+	makechild(s, new, s->text[s->pos + s->matchlen], s->pos);
 }
 
-static void insert_node(void)
+static void insert_node(ar_state *s)
 {
 	node q, r, j, t;
 	uchar c, *t1, *t2;
 
-	if (matchlen >= 4) {
-		matchlen--;
-		r = (matchpos + 1) | DICSIZ;
-		while ((q = parent[r]) == NIL) r = next[r];
-		while (level[q] >= matchlen) {
-			r = q;  q = parent[q];
+	if (s->matchlen >= 4) {
+		s->matchlen--;
+		r = (s->matchpos + 1) | s->dicsiz;
+		while ((q = s->parent[r]) == NIL) r = s->next[r];
+		while (s->level[q] >= s->matchlen) {
+			r = q;  q = s->parent[q];
 		}
 		#if PERCOLATE
 			t = q;
-			while (position[t] < 0) {
-				position[t] = pos;  t = parent[t];
+			while (s->position[t] < 0) {
+				s->position[t] = s->pos;  t = s->parent[t];
 			}
-			if (t < DICSIZ) position[t] = pos | PERC_FLAG;
+			if (t < s->dicsiz) s->position[t] = s->pos | PERC_FLAG;
 		#else
 			t = q;
-			while (t < DICSIZ) {
-				position[t] = pos;  t = parent[t];
+			while (t < s->dicsiz) {
+				s->position[t] = s->pos;  t = s->parent[t];
 			}
 		#endif
 	} else {
-		q = text[pos] + DICSIZ;  c = text[pos + 1];
-		if ((r = child(q, c)) == NIL) {
-			makechild(q, c, pos);  matchlen = 1;
+		q = s->text[s->pos] + s->dicsiz;  c = s->text[s->pos + 1];
+		if ((r = child(s, q, c)) == NIL) {
+			makechild(s, q, c, s->pos);  s->matchlen = 1;
 			return;
 		}
-		matchlen = 2;
+		s->matchlen = 2;
 	}
 	for ( ; ; ) {
-		if (r >= DICSIZ) {
-			j = MAXMATCH;  matchpos = r;
+		if (r >= s->dicsiz) {
+			j = MAXMATCH;  s->matchpos = r;
 		} else {
-			j = level[r];
-			matchpos = position[r] & ~PERC_FLAG;
+			j = s->level[r];
+			s->matchpos = s->position[r] & ~PERC_FLAG;
 		}
-		if (matchpos >= pos) matchpos -= DICSIZ;
-		t1 = &text[pos + matchlen];  t2 = &text[matchpos + matchlen];
-		while (matchlen < j) {
-			if (*t1 != *t2) {  split(r);  return;  }
-			matchlen++;  t1++;  t2++;
+		if (s->matchpos >= s->pos) s->matchpos -= s->dicsiz;
+		t1 = &s->text[s->pos + s->matchlen];
+		t2 = &s->text[s->matchpos + s->matchlen];
+		while (s->matchlen < j) {
+			if (*t1 != *t2) {  split(s, r);  return;  }
+			s->matchlen++;  t1++;  t2++;
 		}
-		if (matchlen >= MAXMATCH) break;
-		position[r] = pos;
+		if (s->matchlen >= MAXMATCH) break;
+		s->position[r] = s->pos;
 		q = r;
-		if ((r = child(q, *t1)) == NIL) {
-			makechild(q, *t1, pos);  return;
+		if ((r = child(s, q, *t1)) == NIL) {
+			makechild(s, q, *t1, s->pos);  return;
 		}
-		matchlen++;
+		s->matchlen++;
 	}
-	t = prev[r];  prev[pos] = t;  next[t] = pos;
-	t = next[r];  next[pos] = t;  prev[t] = pos;
-	parent[pos] = q;  parent[r] = NIL;
-	next[r] = pos;  /* special use of next[] */
+	t = s->prev[r];  s->prev[s->pos] = t;  s->next[t] = s->pos;
+	t = s->next[r];  s->next[s->pos] = t;  s->prev[t] = s->pos;
+	s->parent[s->pos] = q;  s->parent[r] = NIL;
+	s->next[r] = s->pos;  /* special use of next[] */
 }
 
-static void delete_node(void)
+static void delete_node(ar_state *s)
 {
 	#if PERCOLATE
-		node q, r, s, t, u;
+		node q, r, t, u, v;
 	#else
-		node r, s, t, u;
+		node r, t, u, v;
 	#endif
 
-	if (parent[pos] == NIL) return;
-	r = prev[pos];  s = next[pos];
-	next[r] = s;  prev[s] = r;
-	r = parent[pos];  parent[pos] = NIL;
-	if (r >= DICSIZ || --childcount[r] > 1) return;
+	if (s->parent[s->pos] == NIL) return;
+	r = s->prev[s->pos];  v = s->next[s->pos];
+	s->next[r] = v;  s->prev[v] = r;
+	r = s->parent[s->pos];  s->parent[s->pos] = NIL;
+	if (r >= s->dicsiz || --s->childcount[r] > 1) return;
 	#if PERCOLATE
-		t = position[r] & ~PERC_FLAG;
+		t = s->position[r] & ~PERC_FLAG;
 	#else
-		t = position[r];
+		t = s->position[r];
 	#endif
-	if (t >= pos) t -= DICSIZ;
+	if (t >= s->pos) t -= s->dicsiz;
 	#if PERCOLATE
-		s = t;  q = parent[r];
-		while ((u = position[q]) & PERC_FLAG) {
-			u &= ~PERC_FLAG;  if (u >= pos) u -= DICSIZ;
-			if (u > s) s = u;
-			position[q] = (s | DICSIZ);  q = parent[q];
+		v = t;  q = s->parent[r];
+		while ((u = s->position[q]) & PERC_FLAG) {
+			u &= ~PERC_FLAG;  if (u >= s->pos) u -= s->dicsiz;
+			if (u > v) v = u;
+			s->position[q] = (v | s->dicsiz);  q = s->parent[q];
 		}
-		if (q < DICSIZ) {
-			if (u >= pos) u -= DICSIZ;
-			if (u > s) s = u;
-			position[q] = s | DICSIZ | PERC_FLAG;
+		if (q < s->dicsiz) {
+			if (u >= s->pos) u -= s->dicsiz;
+			if (u > v) v = u;
+			s->position[q] = v | s->dicsiz | PERC_FLAG;
 		}
 	#endif
-	s = child(r, text[t + level[r]]);
-	t = prev[s];  u = next[s];
-	next[t] = u;  prev[u] = t;
-	t = prev[r];  next[t] = s;  prev[s] = t;
-	t = next[r];  prev[t] = s;  next[s] = t;
-	parent[s] = parent[r];  parent[r] = NIL;
-	next[r] = avail;  avail = r;
+	v = child(s, r, s->text[t + s->level[r]]);
+	t = s->prev[v];  u = s->next[v];
+	s->next[t] = u;  s->prev[u] = t;
+	t = s->prev[r];  s->next[t] = v;  s->prev[v] = t;
+	t = s->next[r];  s->prev[t] = v;  s->next[v] = t;
+	s->parent[v] = s->parent[r];  s->parent[r] = NIL;
+	s->next[r] = s->avail;  s->avail = r;
 }
 
-static void get_next_match(void)
+static void read_text(ar_state *s)
+	/* Fill textbuf[] after s->textend, moving the part from
+	   s->text on to the front first if text[] would not fit. */
 {
 	int n;
 
-	remainder--;
-	if (++pos == DICSIZ * 2) {
-		memmove(&text[0], &text[DICSIZ], DICSIZ + MAXMATCH);
-		n = fread_crc(&text[DICSIZ + MAXMATCH], DICSIZ, infile);
-        remainder += n;  pos = DICSIZ;  putc('.', stderr);  numper++;
+	if (s->text + s->dicsiz * 2 + MAXMATCH > s->textbuf + TEXTSIZ) {
+		n = (int)(s->textend - s->text);
+		memmove(s->textbuf, s->text, n);
+		s->text = s->textbuf;  s->textend = s->textbuf + n;
+	}
+	n = fread_crc(s, s->textend,
+				  (int)(s->textbuf + TEXTSIZ - s->textend), s->infile);
+	s->textend += n;  s->remainder += n;
+}
+
+static int advance(ar_state *s)
+	/* Go on to the next position.  When the end of text[] is
+	   reached, text moves dicsiz on in textbuf[] (positions
+	   go down by dicsiz).  Nonzero if it moved. */
+{
+	s->remainder--;
+	if (++s->pos != s->dicsiz * 2) return 0;
+	s->text += s->dicsiz;  s->pos = s->dicsiz;
+	if (s->textend < s->text + s->dicsiz * 2 + MAXMATCH) read_text(s);
+	if (s->progress) {  putc('.', stderr);  s->numper++;  }
+	return 1;
+}
+
+static void get_next_match(ar_state *s)
+{
+	advance(s);
+	delete_node(s);  insert_node(s);
+}
+
+/***** hash chains (levels 1 to 8) *****/
+
+/* Instead of the tree, next[0 .. 2 * dicsiz - 1] holds the
+   latest position for each hash of three bytes, and
+   prev[pos & (dicsiz - 1)] the one before pos with the same
+   hash.  Only chainmax of them are tried. */
+
+static struct {
+	int chain;  /* positions to try */
+	int lazy;   /* look one byte on if the match is shorter */
+	int nice;   /* stop at a match this long */
+	int opt;    /* optimal parsing (binary trees) */
+} config[10] = {
+	{    0,   0,   0, 0 },  /* 0: the tree */
+	{    4,   0,   8, 0 },  /* 1: fastest */
+	{    8,   0,  16, 0 },
+	{   32,   0,  32, 0 },
+	{   32,  16,  64, 0 },
+	{   64,  32, 128, 0 },
+	{  128,  64, 128, 0 },
+	{  256, 128, 256, 0 },
+	{ 1024, 256, 256, 0 },
+	{  256,   0, 192, 1 }   /* 9: best */
+};
+
+void ar_encoder_level(ar_state *s, int level)
+	/* 0: the tree (default), 1 (fastest) .. 8: hash chains,
+	   9: binary trees and optimal parsing.  From 1 on, Huffman
+	   blocks end where the data changes. */
+{
+	s->chainmax = config[level].chain;
+	s->lazy     = config[level].lazy;
+	s->nice     = config[level].nice;
+	s->optimal  = config[level].opt;
+	s->split    = (level != 0);  /* 0: blocks of 16K bytes */
+}
+
+#define HASH3(p) ((((uint)s->text[p] << (2 * s->hshift)) \
+	^ ((uint)s->text[(p) + 1] << s->hshift) ^ s->text[(p) + 2]) \
+	& (2 * s->dicsiz - 1))
+
+static void slide_hash(ar_state *s)
+	/* After advance() slid text[], positions are dicsiz less. */
+{
+	uint i;
+
+	for (i = 0; i < s->dicsiz * 2; i++) {
+		s->next[i] = (s->next[i] > s->dicsiz) ? s->next[i] - s->dicsiz : NIL;
+		s->prev[i] = (s->prev[i] > s->dicsiz) ? s->prev[i] - s->dicsiz : NIL;
+	}
+}
+
+static void next_hash(ar_state *s)
+	/* Put s->pos on its chain and go on to the next. */
+{
+	uint h;
+
+	h = HASH3(s->pos);
+	s->prev[s->pos & (s->dicsiz - 1)] = s->next[h];
+	s->next[h] = s->pos;
+	if (advance(s)) slide_hash(s);
+}
+
+static void find_match(ar_state *s)
+	/* Longest match for s->pos in its chain.  s->matchlen = 0
+	   if none is THRESHOLD long. */
+{
+	node cur, limit;
+	int chain, len, best;
+	uchar *scan, *m;
+
+	best = THRESHOLD - 1;
+	scan = &s->text[s->pos];
+	limit = s->pos - s->dicsiz;
+	chain = s->chainmax;
+	for (cur = s->next[HASH3(s->pos)]; cur > limit && chain-- != 0;
+		 cur = s->prev[cur & (s->dicsiz - 1)]) {
+		m = &s->text[cur];
+		if (m[best] != scan[best] || m[0] != scan[0]) continue;
+		for (len = 1; len < MAXMATCH && m[len] == scan[len]; len++) ;
+		if (len > best) {
+			best = len;  s->matchpos = cur;
+			if (len >= s->nice) break;
+		}
+	}
+	if (best > s->remainder) best = s->remainder;
+	s->matchlen = (best < THRESHOLD) ? 0 : best;
+}
+
+static void encode_hash(ar_state *s)
+{
+	int n, prevlen, pending;
+	node prevpos;
+
+	if (s->lazy == 0) {  /* greedy: take each match found */
+		while (s->remainder > 0 && ! s->unpackable) {
+			find_match(s);
+			if (s->matchlen == 0) {
+				output(s, s->text[s->pos], 0);  next_hash(s);
+			} else {
+				output(s, s->matchlen + (UCHAR_MAX + 1 - THRESHOLD),
+					   s->pos - s->matchpos - 1);
+				for (n = s->matchlen; n > 0; n--) next_hash(s);
+			}
+		}
+		return;
+	}
+	prevlen = pending = 0;  prevpos = NIL;
+	while (s->remainder > 0 && ! s->unpackable) {
+		if (prevlen < s->lazy) find_match(s);  else s->matchlen = 0;
+		if (prevlen != 0 && s->matchlen <= prevlen) {
+			/* the match at s->pos - 1 is not beaten */
+			output(s, prevlen + (UCHAR_MAX + 1 - THRESHOLD),
+				   (s->pos - prevpos - 2) & (s->dicsiz - 1));
+			for (n = prevlen - 1; n > 0; n--) next_hash(s);
+			prevlen = pending = 0;
+		} else {
+			if (pending) output(s, s->text[s->pos - 1], 0);
+			pending = 1;  prevlen = s->matchlen;  prevpos = s->matchpos;
+			next_hash(s);
+		}
+	}
+	if (pending && ! s->unpackable) output(s, s->text[s->pos - 1], 0);
+}
+
+/***** binary trees and optimal parsing (level 9) *****/
+
+/* next[] again holds the latest position for each hash, now
+   the root of a binary tree of the earlier ones, ordered by
+   the text that follows them.  The children of a position p
+   are SMALLER(p) and LARGER(p). */
+
+#define SMALLER(p) s->prev[(p) & (s->dicsiz - 1)]
+#define LARGER(p)  s->prev[((p) & (s->dicsiz - 1)) + s->dicsiz]
+
+#define OPTSIZ 4096  /* positions parsed at a time */
+#define NOPRICE 12   /* bits for a code the last block did not use */
+
+typedef struct {
+	ulong cost;  /* bits to get to this position */
+	uint  len;   /* of the step that got here; 1 = a literal */
+	uint  dist;  /* of that step, if a match */
+	uint  next;  /* to the next step, once the path is chosen */
+} optnode;
+
+static int bt_insert(ar_state *s, uint *lens, uint *dists)
+	/* Put s->pos into its tree.  The matches met on the way,
+	   each longer than the last, go into lens[] and dists[]
+	   unless they are NULL.  Returns how many there were. */
+{
+	node cur, limit, *lt, *gt;
+	uint h;
+	int n, len, lenlt, lengt, best, cut, max;
+	uchar *scan, *m;
+
+	h = HASH3(s->pos);
+	cur = s->next[h];  s->next[h] = s->pos;
+	lt = &SMALLER(s->pos);  gt = &LARGER(s->pos);
+	max = (s->remainder < MAXMATCH) ? s->remainder : MAXMATCH;
+	scan = &s->text[s->pos];
+	limit = s->pos - s->dicsiz;
+	lenlt = lengt = 0;  best = THRESHOLD - 1;  n = 0;
+	cut = s->chainmax;
+	while (cur > limit && cut-- != 0) {
+		m = &s->text[cur];
+		len = (lenlt < lengt) ? lenlt : lengt;
+		while (len < max && m[len] == scan[len]) len++;
+		if (len > best) {
+			best = len;
+			if (lens != NULL) {  lens[n] = len;  dists[n] = s->pos - cur;  }
+			n++;
+			if (len == max) {  /* pos takes the place of cur */
+				*lt = SMALLER(cur);  *gt = LARGER(cur);
+				return n;
+			}
+		}
+		if (len < max && m[len] < scan[len]) {
+			*lt = cur;  lt = &LARGER(cur);  cur = *lt;  lenlt = len;
+		} else {
+			*gt = cur;  gt = &SMALLER(cur);  cur = *gt;  lengt = len;
+		}
+	}
+	*lt = *gt = NIL;
+	return n;
+}
+
+static uint price_p(ar_state *s, uint p)  /* bits to send p */
+{
+	uint c;
+
+	c = NBITS(p);
+	return ((s->pt_len[c] != 0) ? s->pt_len[c] : s->pbit)
+		   + ((c > 1) ? c - 1 : 0);
+}
+
+#define PRICE_C(c) ((s->c_len[c] != 0) ? s->c_len[c] : NOPRICE)
+
+static void encode_opt(ar_state *s)
+	/* Choose the cheapest way through up to OPTSIZ positions,
+	   pricing codes by the lengths of the last block sent. */
+{
+	optnode *o;
+	uint *lens, *dists, pp;
+	int i, j, k, n, len, last, end;
+	node base;
+	ulong c;
+
+	if (s->opt == NULL
+	 && (s->opt = malloc((OPTSIZ + 1) * sizeof(optnode)
+						  + 2 * MAXMATCH * sizeof(uint))) == NULL) {
+		fail(s, "Out of memory.");  return;
+	}
+	o = s->opt;
+	lens = (uint *)(o + OPTSIZ + 1);  dists = lens + MAXMATCH;
+	while (s->remainder > 0 && ! s->unpackable) {
+		end = (s->remainder < OPTSIZ) ? s->remainder : OPTSIZ;
+		base = s->pos;
+		o[0].cost = 0;
+		for (j = 1; j <= end; j++) o[j].cost = ULONG_MAX;
+		for (i = 0; i < end; i++) {
+			n = bt_insert(s, lens, dists);
+			c = o[i].cost + PRICE_C(s->text[s->pos]);
+			if (c < o[i + 1].cost) {
+				o[i + 1].cost = c;  o[i + 1].len = 1;
+			}
+			len = THRESHOLD;
+			for (k = 0; k < n; k++) {
+				pp = price_p(s, dists[k] - 1);
+				last = (lens[k] < end - i) ? lens[k] : end - i;
+				for ( ; len <= last; len++) {
+					c = o[i].cost + pp
+						+ PRICE_C(len + (UCHAR_MAX + 1 - THRESHOLD));
+					if (c < o[i + len].cost) {
+						o[i + len].cost = c;
+						o[i + len].len = len;  o[i + len].dist = dists[k];
+					}
+				}
+			}
+			if (advance(s)) {  slide_hash(s);  base -= s->dicsiz;  }
+			if (n != 0 && lens[n - 1] >= s->nice
+			 && lens[n - 1] <= (uint)(end - i)) {
+				/* take a long match that fits; skip over it */
+				end = i + lens[n - 1];  o[end].len = lens[n - 1];
+				o[end].dist = dists[n - 1];
+				while (++i < end)
+					if (bt_insert(s, NULL, NULL), advance(s)) {
+						slide_hash(s);  base -= s->dicsiz;
+					}
+			}
+		}
+		for (j = end; j > 0; j = k) {  /* path back to front */
+			k = j - o[j].len;  o[k].next = j;
+		}
+		for (j = 0; j < end && ! s->unpackable; j = k) {
+			k = o[j].next;
+			if (k - j == 1) output(s, s->text[base + j], 0);
+			else output(s, k - j + (UCHAR_MAX + 1 - THRESHOLD),
+						o[k].dist - 1);
+		}
 	}
-	delete_node();  insert_node();
 }
 
-void encode(void)
+/***** both *****/
+
+static void encode_tree(ar_state *s)
 {
 	int lastmatchlen;
 	node lastmatchpos;
 
-    numper=0;
-
-    allocate_memory();  init_slide();  huf_encode_start();
-	remainder = fread_crc(&text[DICSIZ], DICSIZ + MAXMATCH, infile);
-    putc('.', stderr); numper++;
-	matchlen = 0;
-	pos = DICSIZ;  insert_node();
-	if (matchlen > remainder) matchlen = remainder;
-	while (remainder > 0 && ! unpackable) {
-		lastmatchlen = matchlen;  lastmatchpos = matchpos;
-		get_next_match();
-		if (matchlen > remainder) matchlen = remainder;
-		if (matchlen > lastmatchlen || lastmatchlen < THRESHOLD)
-			output(text[pos - 1], 0);
+	s->matchlen = 0;  insert_node(s);
+	if (s->matchlen > s->remainder) s->matchlen = s->remainder;
+	while (s->remainder > 0 && ! s->unpackable) {
+		lastmatchlen = s->matchlen;  lastmatchpos = s->matchpos;
+		get_next_match(s);
+		if (s->matchlen > s->remainder) s->matchlen = s->remainder;
+		if (s->matchlen > lastmatchlen || lastmatchlen < THRESHOLD)
+			output(s, s->text[s->pos - 1], 0);
 		else {
-			output(lastmatchlen + (UCHAR_MAX + 1 - THRESHOLD),
-				   (pos - lastmatchpos - 2) & (DICSIZ - 1));
-			while (--lastmatchlen > 0) get_next_match();
-			if (matchlen > remainder) matchlen = remainder;
+			output(s, lastmatchlen + (UCHAR_MAX + 1 - THRESHOLD),
+				   (s->pos - lastmatchpos - 2) & (s->dicsiz - 1));
+			while (--lastmatchlen > 0) get_next_match(s);
+			if (s->matchlen > s->remainder) s->matchlen = s->remainder;
 		}
 	}
-	huf_encode_end();
+}
+
+void encode(ar_state *s)
+{
+	uint i;
+
+	s->numper = 0;
+
+	if (s->chainmax == 0) init_slide(s);
+	else {
+		for (i = 0; i < s->dicsiz * 2; i++) s->next[i] = s->prev[i] = NIL;
+		s->hshift = (s->dicbit + 1 + THRESHOLD - 1) / THRESHOLD;
+	}
+	huf_encode_start(s);
+	s->text = s->textbuf;  s->textend = s->text + s->dicsiz;
+	s->remainder = 0;  read_text(s);
+	if (s->progress) {  putc('.', stderr);  s->numper++;  }
+	s->pos = s->dicsiz;
+	if (s->chainmax == 0) encode_tree(s);
+	else if (s->optimal)  encode_opt(s);
+	else                  encode_hash(s);
+	huf_encode_end(s);
 
-    for (; numper < 15; numper++)
-        putc (' ', stderr);
+	if (s->progress)
+		for ( ; s->numper < 15; s->numper++)
+			putc(' ', stderr);
 }
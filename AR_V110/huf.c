@@ -2,32 +2,36 @@
 	huf.c -- static Huffman
 ***********************************************************/
 #include <stdlib.h>
+#include <string.h>  /* memmove() */
 #include "ar.h"
 
-#define NP (DICBIT + 1)
-#define NT (CODE_BIT + 3)
-#define PBIT 4  /* smallest integer such that (1U << PBIT) > NP */
-#define TBIT 5  /* smallest integer such that (1U << TBIT) > NT */
-#if NT > NP
-	#define NPT NT
+#define SPLITSYMS 1024  /* a block may end every this many symbols */
+#if UINT_MAX > 0xFFFFU
+	#define MAXTOK 0xFFFFU  /* room for tokens; a block holds 65528 */
 #else
-	#define NPT NP
+	#define MAXTOK (0xFFF0U / sizeof(ushort))
 #endif
+#define BLOCKBYTES (16 * 1024U)
+	/* Without split, a block ends where this many bytes would
+	   have filled: a flag byte for 8 tokens, one for a char and
+	   tokenmax for a match, as they were once kept. */
 
-ushort left[2 * NC - 1], right[2 * NC - 1];
-static uchar *buf, c_len[NC], pt_len[NPT];
-static uint   bufsiz = 0, blocksize;
-static ushort c_freq[2 * NC - 1], c_table[4096], c_code[NC],
-			  p_freq[2 * NP - 1], pt_table[256], pt_code[NPT],
-			  t_freq[2 * NT - 1];
+#define R4(n)  n, n, n, n
+#define R16(n) R4(n), R4(n), R4(n), R4(n)
+
+const uchar nbit_tab[256] = {
+	0, 1, 2, 2, R4(3), R4(4), R4(4), R16(5), R16(6), R16(6),
+	R16(7), R16(7), R16(7), R16(7),
+	R16(8), R16(8), R16(8), R16(8), R16(8), R16(8), R16(8), R16(8)
+};
 
 /***** encoding *****/
 
-static void count_t_freq(void)
+static void count_t_freq(ar_state *s, uchar c_len[])
 {
 	int i, k, n, count;
 
-	for (i = 0; i < NT; i++) t_freq[i] = 0;
+	for (i = 0; i < NT; i++) s->t_freq[i] = 0;
 	n = NC;
 	while (n > 0 && c_len[n - 1] == 0) n--;
 	i = 0;
@@ -36,277 +40,416 @@ static void count_t_freq(void)
 		if (k == 0) {
 			count = 1;
 			while (i < n && c_len[i] == 0) {  i++;  count++;  }
-			if (count <= 2) t_freq[0] += count;
-			else if (count <= 18) t_freq[1]++;
-			else if (count == 19) {  t_freq[0]++;  t_freq[1]++;  }
-			else t_freq[2]++;
-		} else t_freq[k + 2]++;
+			if (count <= 2) s->t_freq[0] += count;
+			else if (count <= 18) s->t_freq[1]++;
+			else if (count == 19) {  s->t_freq[0]++;  s->t_freq[1]++;  }
+			else s->t_freq[2]++;
+		} else s->t_freq[k + 2]++;
 	}
 }
 
-static void write_pt_len(int n, int nbit, int i_special)
+static void write_pt_len(ar_state *s, int n, int nbit, int i_special)
 {
 	int i, k;
 
-	while (n > 0 && pt_len[n - 1] == 0) n--;
-	putbits(nbit, n);
+	while (n > 0 && s->pt_len[n - 1] == 0) n--;
+	putbits(s, nbit, n);
 	i = 0;
 	while (i < n) {
-		k = pt_len[i++];
-		if (k <= 6) putbits(3, k);
-		else putbits(k - 3, (1U << (k - 3)) - 2);
+		k = s->pt_len[i++];
+		if (k <= 6) putbits(s, 3, k);
+		else putbits(s, k - 3, (1U << (k - 3)) - 2);
 		if (i == i_special) {
-			while (i < 6 && pt_len[i] == 0) i++;
-			putbits(2, (i - 3) & 3);
+			while (i < 6 && s->pt_len[i] == 0) i++;
+			putbits(s, 2, (i - 3) & 3);
 		}
 	}
 }
 
-static void write_c_len(void)
+static void write_c_len(ar_state *s)
 {
 	int i, k, n, count;
 
 	n = NC;
-	while (n > 0 && c_len[n - 1] == 0) n--;
-	putbits(CBIT, n);
+	while (n > 0 && s->c_len[n - 1] == 0) n--;
+	putbits(s, CBIT, n);
 	i = 0;
 	while (i < n) {
-		k = c_len[i++];
+		k = s->c_len[i++];
 		if (k == 0) {
 			count = 1;
-			while (i < n && c_len[i] == 0) {  i++;  count++;  }
+			while (i < n && s->c_len[i] == 0) {  i++;  count++;  }
 			if (count <= 2) {
 				for (k = 0; k < count; k++)
-					putbits(pt_len[0], pt_code[0]);
+					putbits(s, s->pt_len[0], s->pt_code[0]);
 			} else if (count <= 18) {
-				putbits(pt_len[1], pt_code[1]);
-				putbits(4, count - 3);
+				putbits(s, s->pt_len[1], s->pt_code[1]);
+				putbits(s, 4, count - 3);
 			} else if (count == 19) {
-				putbits(pt_len[0], pt_code[0]);
-				putbits(pt_len[1], pt_code[1]);
-				putbits(4, 15);
+				putbits(s, s->pt_len[0], s->pt_code[0]);
+				putbits(s, s->pt_len[1], s->pt_code[1]);
+				putbits(s, 4, 15);
 			} else {
-				putbits(pt_len[2], pt_code[2]);
-				putbits(CBIT, count - 20);
+				putbits(s, s->pt_len[2], s->pt_code[2]);
+				putbits(s, CBIT, count - 20);
 			}
-		} else putbits(pt_len[k + 2], pt_code[k + 2]);
+		} else putbits(s, s->pt_len[k + 2], s->pt_code[k + 2]);
+	}
+}
+
+static void encode_c(ar_state *s, int c)
+{
+	putbits(s, s->c_len[c], s->c_code[c]);
+}
+
+static void encode_p(ar_state *s, uint p)
+{
+	uint c;
+
+	c = NBITS(p);
+	putbits(s, s->pt_len[c], s->pt_code[c]);
+	if (c > 1) putbits(s, c - 1, p & (0xFFFFU >> (17 - c)));
+}
+
+static void encode_match(ar_state *s, uint c, uint p)
+	/* Length code c, then p: one putbits() if the bits fit */
+{
+	uint q, n;
+	ulong x;
+
+	q = NBITS(p);
+	n = s->c_len[c] + s->pt_len[q];
+	x = ((ulong)s->c_code[c] << s->pt_len[q]) | s->pt_code[q];
+	if (q > 1) {
+		n += q - 1;  x = (x << (q - 1)) | (p & (0xFFFFU >> (17 - q)));
 	}
+	if (n <= PUTMAX) putbits(s, n, x);
+	else {  encode_c(s, c);  encode_p(s, p);  }
 }
 
-static void encode_c(int c)
+static ulong pt_len_bits(uchar len[], int n, int nbit, int i_special)
+	/* bits write_pt_len() would put, or the two numbers
+	   sent in its place when there is one code */
 {
-	putbits(c_len[c], c_code[c]);
+	int i, k;
+	ulong bits;
+
+	while (n > 0 && len[n - 1] == 0) n--;
+	if (n == 0) return 2 * nbit;
+	bits = nbit;  i = 0;
+	while (i < n) {
+		k = len[i++];
+		bits += (k <= 6) ? 3 : k - 3;
+		if (i == i_special) {
+			while (i < 6 && len[i] == 0) i++;
+			bits += 2;
+		}
+	}
+	return bits;
 }
 
-static void encode_p(uint p)
+static ulong tree_bits(ar_state *s, int n, ushort freq[], uchar len[])
+	/* Bits to send what freq[0..n-1] counts by a code made for
+	   it, whose lengths go to len[] (all 0 if one symbol). */
 {
-	uint c, q;
+	int i;
+	ulong bits;
 
-	c = 0;  q = p;  while (q) {  q >>= 1;  c++;  }
-	putbits(pt_len[c], pt_code[c]);
-	if (c > 1) putbits(c - 1, p & (0xFFFFU >> (17 - c)));
+	make_tree(s, n, freq, len, s->e_code);
+	bits = 0;
+	for (i = 0; i < n; i++) bits += (ulong)freq[i] * len[i];
+	return bits;
 }
 
-static void send_block(void)
+static ulong block_bits(ar_state *s, ushort c_freq[], ushort p_freq[])
+	/* Size of a block with these counts, as send_block()
+	   would write it.  The extra bits of each
+	   position are counted, but not the last byte's padding. */
 {
-	uint i, k, flags, root, pos, size;
+	int i;
+	ulong bits;
 
-	root = make_tree(NC, c_freq, c_len, c_code);
-	size = c_freq[root];  putbits(16, size);
+	bits = 16 + tree_bits(s, NC, c_freq, s->e_c_len);
+	for (i = 0; i < NC && s->e_c_len[i] == 0; i++) ;
+	if (i == NC) bits += 2 * TBIT + 2 * CBIT;
+	else {
+		count_t_freq(s, s->e_c_len);
+		bits += tree_bits(s, NT, s->t_freq, s->e_pt_len)
+			  + pt_len_bits(s->e_pt_len, NT, TBIT, 3) + CBIT
+			  + 4 * (ulong)s->t_freq[1] + CBIT * (ulong)s->t_freq[2];
+	}
+	bits += tree_bits(s, s->np, p_freq, s->e_pt_len)
+		  + pt_len_bits(s->e_pt_len, s->np, s->pbit, -1);
+	for (i = 2; i < s->np; i++) bits += (ulong)p_freq[i] * (i - 1);
+	return bits;
+}
+
+static void send_block(ar_state *s)
+	/* The first size tokens, size from c_freq[] */
+{
+	uint i, j, c, root, size;
+
+	root = make_tree(s, NC, s->c_freq, s->c_len, s->c_code);
+	size = s->c_freq[root];  putbits(s, 16, size);
 	if (root >= NC) {
-		count_t_freq();
-		root = make_tree(NT, t_freq, pt_len, pt_code);
+		count_t_freq(s, s->c_len);
+		root = make_tree(s, NT, s->t_freq, s->pt_len, s->pt_code);
 		if (root >= NT) {
-			write_pt_len(NT, TBIT, 3);
+			write_pt_len(s, NT, TBIT, 3);
 		} else {
-			putbits(TBIT, 0);  putbits(TBIT, root);
+			putbits(s, TBIT, 0);  putbits(s, TBIT, root);
 		}
-		write_c_len();
+		write_c_len(s);
 	} else {
-        putbits(TBIT, 0);  putbits(TBIT, 0);
-		putbits(CBIT, 0);  putbits(CBIT, root);
+		putbits(s, TBIT, 0);  putbits(s, TBIT, 0);
+		putbits(s, CBIT, 0);  putbits(s, CBIT, root);
 	}
-	root = make_tree(NP, p_freq, pt_len, pt_code);
-	if (root >= NP) {
-		write_pt_len(NP, PBIT, -1);
+	root = make_tree(s, s->np, s->p_freq, s->pt_len, s->pt_code);
+	if (root >= s->np) {
+		write_pt_len(s, s->np, s->pbit, -1);
 	} else {
-		putbits(PBIT, 0);  putbits(PBIT, root);
+		putbits(s, s->pbit, 0);  putbits(s, s->pbit, root);
 	}
-	pos = 0;
-	for (i = 0; i < size; i++) {
-		if (i % CHAR_BIT == 0) flags = buf[pos++];  else flags <<= 1;
-		if (flags & (1U << (CHAR_BIT - 1))) {
-			encode_c(buf[pos++] + (1U << CHAR_BIT));
-			k = buf[pos++] << CHAR_BIT;  k += buf[pos++];
-			encode_p(k);
-		} else encode_c(buf[pos++]);
-		if (unpackable) return;
+	for (i = j = 0; i < size; i++) {
+		c = s->tok_c[i];
+		if (c <= UCHAR_MAX) encode_c(s, c);
+		else encode_match(s, c, s->tok_p[j++]);
+		if (s->unpackable) return;
 	}
-	for (i = 0; i < NC; i++) c_freq[i] = 0;
-	for (i = 0; i < NP; i++) p_freq[i] = 0;
+	for (i = 0; i < NC; i++) s->c_freq[i] = 0;
+	for (i = 0; i < s->np; i++) s->p_freq[i] = 0;
+	flush_putbits(s);
 }
 
-static uint output_pos, output_mask;
+static void count_freq(ar_state *s)
+	/* c_freq[] and p_freq[] catch up with the tokens */
+{
+	uint i;
+
+	for (i = s->ccount; i < s->ntok; i++) s->c_freq[s->tok_c[i]]++;
+	for (i = s->pcount; i < s->nmatch; i++) s->p_freq[NBITS(s->tok_p[i])]++;
+	s->ccount = s->ntok;  s->pcount = s->nmatch;
+}
 
-void output(uint c, uint p)
+static void split_block(ar_state *s)
+	/* The tokens since s->segtok start a new block if two
+	   blocks, each with its own tables, cost fewer bits than
+	   one; if not they join the block before them. */
 {
-	static uint cpos;
-
-	if ((output_mask >>= 1) == 0) {
-		output_mask = 1U << (CHAR_BIT - 1);
-		if (output_pos >= bufsiz - 3 * CHAR_BIT) {
-			send_block();
-			if (unpackable) return;
-			output_pos = 0;
-		}
-		cpos = output_pos++;  buf[cpos] = 0;
+	uint i, n;
+	ulong whole, part;
+
+	count_freq(s);
+	whole = block_bits(s, s->c_freq, s->p_freq);
+	if (s->segtok == 0) part = whole;
+	else {
+		for (i = 0; i < NC; i++)
+			s->e_c_freq[i] = s->c_freq[i] - s->b_c_freq[i];
+		for (i = 0; i < s->np; i++)
+			s->e_p_freq[i] = s->p_freq[i] - s->b_p_freq[i];
+		part = block_bits(s, s->e_c_freq, s->e_p_freq);
 	}
-	buf[output_pos++] = (uchar) c;  c_freq[c]++;
-	if (c >= (1U << CHAR_BIT)) {
-		buf[cpos] |= output_mask;
-		buf[output_pos++] = (uchar)(p >> CHAR_BIT);
-		buf[output_pos++] = (uchar) p;
-		c = 0;  while (p) {  p >>= 1;  c++;  }
-		p_freq[c]++;
+	if (s->segtok != 0 && s->b_bits + part < whole) {
+		for (i = 0; i < NC; i++) s->c_freq[i] = s->b_c_freq[i];
+		for (i = 0; i < s->np; i++) s->p_freq[i] = s->b_p_freq[i];
+		send_block(s);
+		if (s->unpackable) return;
+		n = s->ntok - s->segtok;
+		memmove(s->tok_c, s->tok_c + s->segtok, n * sizeof(*s->tok_c));
+		s->ntok = s->ccount = n;
+		n = s->nmatch - s->segmatch;
+		memmove(s->tok_p, s->tok_p + s->segmatch, n * sizeof(*s->tok_p));
+		s->nmatch = s->pcount = n;
+		for (i = 0; i < NC; i++) s->c_freq[i] = s->e_c_freq[i];
+		for (i = 0; i < s->np; i++) s->p_freq[i] = s->e_p_freq[i];
+		whole = part;
 	}
+	s->b_bits = whole;
+	s->segtok = s->ntok;  s->segmatch = s->nmatch;
+	for (i = 0; i < NC; i++) s->b_c_freq[i] = s->c_freq[i];
+	for (i = 0; i < s->np; i++) s->b_p_freq[i] = s->p_freq[i];
 }
 
-void huf_encode_start(void)
+static void clear_block(ar_state *s)  /* after send_block() of all */
 {
 	int i;
 
-	if (bufsiz == 0) {
-		bufsiz = 16 * 1024U;
-		while ((buf = malloc(bufsiz)) == NULL) {
-			bufsiz = (bufsiz / 10U) * 9U;
-			if (bufsiz < 4 * 1024U) error("Out of memory.");
+	s->ntok = s->nmatch = s->ccount = s->pcount = 0;
+	s->segtok = s->segmatch = 0;
+	for (i = 0; i < NC; i++) s->b_c_freq[i] = 0;
+	for (i = 0; i < s->np; i++) s->b_p_freq[i] = 0;
+}
+
+void output(ar_state *s, uint c, uint p)
+	/* A char c, or a length code c and position p.  Counts
+	   are taken only when they are needed, by count_freq(). */
+{
+	if (s->ntok % CHAR_BIT == 0) {  /* a block may end here */
+		if (s->split && s->ntok - s->segtok >= SPLITSYMS) {
+			split_block(s);
+			if (s->unpackable) return;
+		}
+		if (s->ntok + CHAR_BIT > s->maxtok || (! s->split
+		 && s->ntok / CHAR_BIT + s->ntok + s->nmatch * (s->tokenmax - 1)
+			>= BLOCKBYTES - s->tokenmax * CHAR_BIT)) {
+			count_freq(s);  send_block(s);
+			if (s->unpackable) return;
+			clear_block(s);
 		}
 	}
-	buf[0] = 0;
-	for (i = 0; i < NC; i++) c_freq[i] = 0;
-	for (i = 0; i < NP; i++) p_freq[i] = 0;
-	output_pos = output_mask = 0;
-	init_putbits();
+	s->tok_c[s->ntok++] = c;
+	if (c > UCHAR_MAX) s->tok_p[s->nmatch++] = p;
 }
 
-void huf_encode_end(void)
+void huf_encode_start(ar_state *s)
 {
-	if (! unpackable) {
-		send_block();
-		putbits(CHAR_BIT - 1, 0);  /* flush remaining bits */
+	int i;
+	uint n;
+
+	n = (s->split) ? MAXTOK : BLOCKBYTES;
+	if (s->maxtok < n) {
+		free(s->tok_c);  free(s->tok_p);  s->maxtok = n;
+		for ( ; ; ) {
+			s->tok_c = malloc(s->maxtok * sizeof(*s->tok_c));
+			s->tok_p = malloc(s->maxtok * sizeof(*s->tok_p));
+			if (s->tok_c != NULL && s->tok_p != NULL) break;
+			free(s->tok_c);  free(s->tok_p);
+			s->maxtok = (s->maxtok / 10U) * 9U;
+			if (s->maxtok < 2 * 1024U) {
+				s->tok_c = NULL;  s->tok_p = NULL;  s->maxtok = 0;
+				fail(s, "Out of memory.");  return;
+			}
+		}
+	}
+	s->tokenmax = (s->dicbit > 2 * CHAR_BIT) ? 4 : 3;  /* bytes */
+	for (i = 0; i < NC; i++) s->c_freq[i] = s->c_len[i] = 0;
+	for (i = 0; i < s->np; i++) s->p_freq[i] = 0;
+	for (i = 0; i < NPT; i++) s->pt_len[i] = 0;  /* no prices yet */
+	clear_block(s);
+	init_putbits(s);
+}
+
+void huf_encode_end(ar_state *s)
+{
+	if (s->split && ! s->unpackable) split_block(s);
+	if (! s->unpackable) {
+		count_freq(s);  send_block(s);
+		putbits(s, CHAR_BIT - 1, 0);  /* flush remaining bits */
+		flush_putbits(s);
 	}
 }
 
 /***** decoding *****/
 
-static void read_pt_len(int nn, int nbit, int i_special)
+static int read_pt_len(ar_state *s, int nn, int nbit, int i_special)
+	/* 0 if the table is bad */
 {
 	int i, c, n;
-	uint mask;
+	ulong mask;
 
-	n = getbits(nbit);
+	n = getbits(s, nbit);
+	if (n > nn) return 0;
 	if (n == 0) {
-		c = getbits(nbit);
-		for (i = 0; i < nn; i++) pt_len[i] = 0;
-		for (i = 0; i < 256; i++) pt_table[i] = c;
+		if ((c = getbits(s, nbit)) >= nn) return 0;
+		for (i = 0; i < nn; i++) s->pt_len[i] = 0;
+		for (i = 0; i < 256; i++) s->pt_table[i] = c;
 	} else {
 		i = 0;
 		while (i < n) {
-			c = bitbuf >> (BITBUFSIZ - 3);
+			c = (int)(s->bitbuf >> (BITBUFSIZ - 3));
 			if (c == 7) {
-				mask = 1U << (BITBUFSIZ - 1 - 3);
-				while (mask & bitbuf) {  mask >>= 1;  c++;  }
+				mask = 1UL << (BITBUFSIZ - 1 - 3);
+				while (mask & s->bitbuf) {  mask >>= 1;  c++;  }
+				if (c > 16) return 0;
 			}
-			fillbuf((c < 7) ? 3 : c - 3);
-			pt_len[i++] = c;
+			fillbuf(s, (c < 7) ? 3 : c - 3);
+			s->pt_len[i++] = c;
 			if (i == i_special) {
-				c = getbits(2);
-				while (--c >= 0) pt_len[i++] = 0;
+				c = getbits(s, 2);
+				while (--c >= 0) s->pt_len[i++] = 0;
 			}
 		}
-		while (i < nn) pt_len[i++] = 0;
-		make_table(nn, pt_len, 8, pt_table);
+		while (i < nn) s->pt_len[i++] = 0;
+		return make_table(nn, s->pt_len, 8, s->pt_table);
 	}
+	return 1;
 }
 
-static void read_c_len(void)
+static int read_c_len(ar_state *s)  /* 0 if the table is bad */
 {
 	int i, c, n;
-	uint mask;
 
-	n = getbits(CBIT);
+	n = getbits(s, CBIT);
+	if (n > NC) return 0;
 	if (n == 0) {
-		c = getbits(CBIT);
-		for (i = 0; i < NC; i++) c_len[i] = 0;
-		for (i = 0; i < 4096; i++) c_table[i] = c;
+		if ((c = getbits(s, CBIT)) >= NC) return 0;
+		for (i = 0; i < NC; i++) s->c_len[i] = 0;
+		for (i = 0; i < 4096; i++) s->c_table[i] = c;
 	} else {
 		i = 0;
 		while (i < n) {
-			c = pt_table[bitbuf >> (BITBUFSIZ - 8)];
-			if (c >= NT) {
-				mask = 1U << (BITBUFSIZ - 1 - 8);
-				do {
-					if (bitbuf & mask) c = right[c];
-					else               c = left [c];
-					mask >>= 1;
-				} while (c >= NT);
-			}
-			fillbuf(pt_len[c]);
+			c = s->pt_table[s->bitbuf >> (BITBUFSIZ - 8)];
+			if (c >= NT) c = s->pt_table[c - NT
+				+ ((uint)(s->bitbuf >> (BITBUFSIZ - 16)) & 0xFF)];
+			fillbuf(s, s->pt_len[c]);
 			if (c <= 2) {
 				if      (c == 0) c = 1;
-				else if (c == 1) c = getbits(4) + 3;
-				else             c = getbits(CBIT) + 20;
-				while (--c >= 0) c_len[i++] = 0;
-			} else c_len[i++] = c - 2;
+				else if (c == 1) c = getbits(s, 4) + 3;
+				else             c = getbits(s, CBIT) + 20;
+				if (i + c > NC) return 0;
+				while (--c >= 0) s->c_len[i++] = 0;
+			} else s->c_len[i++] = c - 2;
 		}
-		while (i < NC) c_len[i++] = 0;
-		make_table(NC, c_len, 12, c_table);
+		while (i < NC) s->c_len[i++] = 0;
+		return make_table(NC, s->c_len, 12, s->c_table);
 	}
+	return 1;
 }
 
-uint decode_c(void)
+static void bad_table(ar_state *s)
+	/* Note it in s->fault.  The tables are left so that they
+	   decode only zeros, which the caller throws away. */
 {
-	uint j, mask;
+	int i;
 
-	if (blocksize == 0) {
-		blocksize = getbits(16);
-		read_pt_len(NT, TBIT, 3);
-		read_c_len();
-		read_pt_len(NP, PBIT, -1);
-	}
-	blocksize--;
-	j = c_table[bitbuf >> (BITBUFSIZ - 12)];
-	if (j >= NC) {
-		mask = 1U << (BITBUFSIZ - 1 - 12);
-		do {
-			if (bitbuf & mask) j = right[j];
-			else               j = left [j];
-			mask >>= 1;
-		} while (j >= NC);
+	fail(s, "Bad table");
+	for (i = 0; i < NC; i++) s->c_len[i] = 0;
+	for (i = 0; i < 4096; i++) s->c_table[i] = 0;
+	for (i = 0; i < NPT; i++) s->pt_len[i] = 0;
+	for (i = 0; i < 256; i++) s->pt_table[i] = 0;
+}
+
+uint decode_c(ar_state *s)
+{
+	uint j;
+
+	if (s->blocksize == 0) {
+		s->blocksize = getbits(s, 16);
+		if (! read_pt_len(s, NT, TBIT, 3) || ! read_c_len(s)
+		 || ! read_pt_len(s, s->np, s->pbit, -1)) bad_table(s);
 	}
-	fillbuf(c_len[j]);
+	s->blocksize--;
+	j = s->c_table[s->bitbuf >> (BITBUFSIZ - 12)];
+	if (j >= NC) j = s->c_table[j - NC
+		+ ((uint)(s->bitbuf >> (BITBUFSIZ - 16)) & 0xF)];
+	fillbuf(s, s->c_len[j]);
 	return j;
 }
 
-uint decode_p(void)
+uint decode_p(ar_state *s)
 {
-	uint j, mask;
-
-	j = pt_table[bitbuf >> (BITBUFSIZ - 8)];
-	if (j >= NP) {
-		mask = 1U << (BITBUFSIZ - 1 - 8);
-		do {
-			if (bitbuf & mask) j = right[j];
-			else               j = left [j];
-			mask >>= 1;
-		} while (j >= NP);
-	}
-	fillbuf(pt_len[j]);
-	if (j != 0) j = (1U << (j - 1)) + getbits(j - 1);
+	uint j;
+
+	j = s->pt_table[s->bitbuf >> (BITBUFSIZ - 8)];
+	if (j >= s->np) j = s->pt_table[j - s->np
+		+ ((uint)(s->bitbuf >> (BITBUFSIZ - 16)) & 0xFF)];
+	fillbuf(s, s->pt_len[j]);
+	if (j > 1) j = (1U << (j - 1)) + getbits(s, j - 1);
+		/* j == 1 needs no getbits(s, 0), a shift by BITBUFSIZ */
 	return j;
 }
 
-void huf_decode_start(void)
+void huf_decode_start(ar_state *s)
 {
-	init_getbits();  blocksize = 0;
+	init_getbits(s);  s->blocksize = 0;
 }
@@ -2,31 +2,22 @@
 	io.c -- input/output
 ***********************************************************/
 #include "ar.h"
-#include <stdlib.h>
-#include <stdarg.h>
+#include <string.h>
 
 #define CRCPOLY  0xA001  /* ANSI CRC-16 */
-                         /* CCITT: 0x8408 */
-#define UPDATE_CRC(c) \
-	crc = crctable[(crc ^ (c)) & 0xFF] ^ (crc >> CHAR_BIT)
+                         /* CCITT: 0x8408 (AR_V001, with INIT_CRC 0xFFFF) */
+#define CRCSLICE 8       /* bytes per step of update_crc() */
 
-FILE *arcfile, *infile, *outfile;
-uint crc, bitbuf;
+static ushort crctable[CRCSLICE][UCHAR_MAX + 1];  /* shared, never changes */
+	/* crctable[k][c]: CRC of byte c followed by k zero bytes */
 
-static ushort crctable[UCHAR_MAX + 1];
-static uint  subbitbuf;
-static int   bitcount;
-
-void error(char *fmt, ...)
+void fail(ar_state *s, char *why)
+	/* The stream can't go on.  Nothing here exits: the
+	   encoder stops as if the data would not pack, the
+	   caller finds out from s->fault. */
 {
-	va_list args;
-
-	va_start(args, fmt);
-	putc('\n', stderr);
-	vfprintf(stderr, fmt, args);
-	putc('\n', stderr);
-	va_end(args);
-	exit(EXIT_FAILURE);
+	if (s->fault == NULL) s->fault = why;
+	s->unpackable = 1;
 }
 
 void make_crctable(void)
@@ -38,74 +29,162 @@ void make_crctable(void)
 		for (j = 0; j < CHAR_BIT; j++)
 			if (r & 1) r = (r >> 1) ^ CRCPOLY;
 			else       r >>= 1;
-		crctable[i] = r;
+		crctable[0][i] = r;
 	}
+	for (i = 0; i <= UCHAR_MAX; i++)
+		for (j = 1; j < CRCSLICE; j++) {
+			r = crctable[j - 1][i];
+			crctable[j][i] = crctable[0][r & 0xFF] ^ (r >> CHAR_BIT);
+		}
 }
 
-void fillbuf(int n)  /* Shift bitbuf n bits left, read n bits */
+void update_crc(ar_state *s, uchar *p, ulong n)
+	/* Eight bytes a step: the CRC is folded into the first two,
+	   and each byte is looked up by how many follow it. */
 {
-	bitbuf <<= n;
-	while (n > bitcount) {
-		bitbuf |= subbitbuf << (n -= bitcount);
-		if (compsize != 0) {
-			compsize--;  subbitbuf = (uchar) getc(arcfile);
-		} else subbitbuf = 0;
-		bitcount = CHAR_BIT;
+	uint c;
+
+	c = s->crc;
+	for ( ; n >= CRCSLICE; n -= CRCSLICE, p += CRCSLICE) {
+		c ^= p[0] | ((uint)p[1] << CHAR_BIT);
+		c = crctable[7][c & 0xFF] ^ crctable[6][c >> CHAR_BIT]
+		  ^ crctable[5][p[2]] ^ crctable[4][p[3]]
+		  ^ crctable[3][p[4]] ^ crctable[2][p[5]]
+		  ^ crctable[1][p[6]] ^ crctable[0][p[7]];
+	}
+	while (n-- != 0)
+		c = crctable[0][(c ^ *p++) & 0xFF] ^ (c >> CHAR_BIT);
+	s->crc = c;
+}
+
+static void refill(ar_state *s)
+	/* Append whole bytes to bitbuf, at least CHAR_BIT * 2 bits.
+	   Past the end of input the reader sees zeros. */
+{
+	uint n, m;
+
+	if (s->inleft < sizeof(ulong) && s->compsize != 0) {
+		n = (uint)s->inleft;  /* inptr may still be NULL if 0 */
+		if (n != 0) memmove(s->iobuf, s->inptr, n);
+		m = (s->compsize < IOBUFSIZ - n) ? (uint)s->compsize : IOBUFSIZ - n;
+		if ((m = fread(s->iobuf + n, 1, m, s->infile)) == 0)
+			s->compsize = 0;  /* truncated */
+		else s->compsize -= m;
+		s->inptr = s->iobuf;  s->inleft = n + m;
+	}
+	if (s->inleft >= sizeof(ulong)) {
+		n = (BITBUFSIZ - s->bitcount) / CHAR_BIT;
+		s->inleft -= n;
+		while (n-- != 0) {
+			s->bitcount += CHAR_BIT;
+			s->bitbuf |= (ulong)*s->inptr++ << (BITBUFSIZ - s->bitcount);
+		}
+	} else {  /* tail */
+		while (s->inleft != 0 && s->bitcount <= BITBUFSIZ - CHAR_BIT) {
+			s->bitcount += CHAR_BIT;  s->inleft--;
+			s->bitbuf |= (ulong)*s->inptr++ << (BITBUFSIZ - s->bitcount);
+		}
+		if (s->inleft == 0) s->bitcount = BITBUFSIZ;
 	}
-	bitbuf |= subbitbuf >> (bitcount -= n);
 }
 
-uint getbits(int n)
+void fillbuf(ar_state *s, int n)  /* Shift bitbuf n bits left, read n bits */
+{
+	s->bitbuf <<= n;
+	if ((s->bitcount -= n) < 2 * CHAR_BIT) refill(s);
+}
+
+uint getbits(ar_state *s, int n)
 {
 	uint x;
 
-	x = bitbuf >> (BITBUFSIZ - n);  fillbuf(n);
+	x = (uint)(s->bitbuf >> (BITBUFSIZ - n));  fillbuf(s, n);
 	return x;
 }
 
-void putbits(int n, uint x)  /* Write rightmost n bits of x */
+static void flushout(ar_state *s)  /* write s->iobuf to s->outfile */
 {
-	if (n < bitcount) {
-		subbitbuf |= x << (bitcount -= n);
-	} else {
-		if (compsize < origsize) {
-			putc(subbitbuf | (x >> (n -= bitcount)), outfile);
-			compsize++;
-		} else unpackable = 1;
-		if (n < CHAR_BIT) {
-			subbitbuf = x << (bitcount = CHAR_BIT - n);
-		} else {
-			if (compsize < origsize) {
-				putc(x >> (n - CHAR_BIT), outfile);
-				compsize++;
-			} else unpackable = 1;
-			subbitbuf = x << (bitcount = 2 * CHAR_BIT - n);
-		}
+	uint n;
+
+	n = (uint)(s->outptr - s->iobuf);
+	if (fwrite(s->iobuf, 1, n, s->outfile) < n) fail(s, "Unable to write");
+	s->outptr = s->iobuf;  s->outleft = IOBUFSIZ;
+}
+
+static void flushbits(ar_state *s)
+	/* Move the whole bytes in bitbuf to the output.  The size
+	   checks are made here, once for all of them. */
+{
+	int k;
+
+	k = s->bitcount / CHAR_BIT;
+	if (s->outleft < k && s->outfile != NULL) flushout(s);
+	if (s->compsize + k > s->origsize || s->outleft < k) {
+		s->unpackable = 1;  s->bitcount -= k * CHAR_BIT;  return;
 	}
+	s->compsize += k;  s->outleft -= k;
+	while (--k >= 0)
+		*s->outptr++ = (uchar)(s->bitbuf >> (s->bitcount -= CHAR_BIT));
+}
+
+void putbits(ar_state *s, int n, ulong x)
+	/* Write rightmost n bits of x, n <= PUTMAX */
+{
+	if (s->bitcount + n > BITBUFSIZ) flushbits(s);
+	s->bitbuf = (s->bitbuf << n) | x;  s->bitcount += n;
+}
+
+void flush_putbits(ar_state *s)
+	/* Write out the whole bytes put so far; the last
+	   partial byte stays in bitbuf. */
+{
+	flushbits(s);
+	if (! s->unpackable && s->outfile != NULL) flushout(s);
 }
 
-int fread_crc(uchar *p, int n, FILE *f)
+int fread_crc(ar_state *s, uchar *p, int n, FILE *f)
+	/* Takes what is left at s->inptr first, then reads f
+	   (if not NULL).  Stops when s->origsize reaches s->readmax. */
 {
 	int i;
 
-	i = n = fread(p, 1, n, f);  origsize += n;
-	while (--i >= 0) UPDATE_CRC(*p++);
-	return n;
+	if (n > s->readmax - s->origsize) n = (int)(s->readmax - s->origsize);
+	i = (n < s->inleft) ? n : (int)s->inleft;
+	memcpy(p, s->inptr, i);
+	s->inptr += i;  s->inleft -= i;
+	if (f != NULL && i < n) i += fread(p + i, 1, n - i, f);
+	s->origsize += i;
+	update_crc(s, p, i);
+	return i;
 }
 
-void fwrite_crc(uchar *p, int n, FILE *f)
+void fwrite_crc(ar_state *s, uchar *p, int n, FILE *f)
+	/* f == NULL: write to s->outptr */
 {
-	if (fwrite(p, 1, n, f) < n) error("Unable to write");
-	while (--n >= 0) UPDATE_CRC(*p++);
+	if (f != NULL) {
+		if (fwrite(p, 1, n, f) < n) fail(s, "Unable to write");
+	} else {
+		if (n > s->outleft) {  fail(s, "Unable to write");  return;  }
+		memcpy(s->outptr, p, n);
+		s->outptr += n;  s->outleft -= n;
+	}
+	update_crc(s, p, n);
 }
 
-void init_getbits(void)
+void init_getbits(ar_state *s)
+	/* Input is s->inleft bytes at s->inptr, then s->compsize
+	   bytes of s->infile read through s->iobuf. */
 {
-	bitbuf = 0;  subbitbuf = 0;  bitcount = 0;
-	fillbuf(BITBUFSIZ);
+	s->bitbuf = 0;  s->bitcount = 0;
+	refill(s);
 }
 
-void init_putbits(void)
+void init_putbits(ar_state *s)
+	/* Output goes to s->outfile through s->iobuf, or if
+	   that is NULL, to the s->outleft bytes at s->outptr. */
 {
-	bitcount = CHAR_BIT;  subbitbuf = 0;
+	s->bitbuf = 0;  s->bitcount = 0;
+	if (s->outfile != NULL) {
+		s->outptr = s->iobuf;  s->outleft = IOBUFSIZ;
+	}
 }
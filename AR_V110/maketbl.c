@@ -3,25 +3,36 @@
 ***********************************************************/
 #include "ar.h"
 
-void make_table(int nchar, uchar bitlen[], int tablebits, ushort table[])
+int make_table(int nchar, uchar bitlen[], int tablebits, ushort table[])
+	/* Codes of up to tablebits bits are looked up directly in
+	   table[0 .. (1U << tablebits) - 1].  For a longer code
+	   that entry is nchar + k, and the next 16 - tablebits
+	   bits index the second-level table at table[k].
+	   Returns 0 if the lengths are not those of a code. */
 {
 	ushort count[17], weight[17], start[18], *p;
 	uint i, k, len, ch, jutbits, avail, nextcode, mask;
+	ulong sum;
 
 	for (i = 1; i <= 16; i++) count[i] = 0;
-	for (i = 0; i < nchar; i++) count[bitlen[i]]++;
+	for (i = 0; i < nchar; i++) {
+		if (bitlen[i] > 16) return 0;
+		count[bitlen[i]]++;
+	}
 
-	start[1] = 0;
-	for (i = 1; i <= 16; i++)
+	start[1] = 0;  sum = 0;
+	for (i = 1; i <= 16; i++) {
 		start[i + 1] = start[i] + (count[i] << (16 - i));
-	if (start[17] != (ushort)(1U << 16)) error("Bad table");
+		sum += (ulong)count[i] << (16 - i);  /* start[] may wrap */
+	}
+	if (sum != 1UL << 16) return 0;
 
 	jutbits = 16 - tablebits;
 	for (i = 1; i <= tablebits; i++) {
 		start[i] >>= jutbits;
 		weight[i] = 1U << (tablebits - i);
 	}
-	while (i <= 16) weight[i++] = 1U << (16 - i);
+	while (i <= 16) {  weight[i] = 1U << (16 - i);  i++;  }
 
 	i = start[tablebits + 1] >> jutbits;
 	if (i != (ushort)(1U << 16)) {
@@ -29,8 +40,8 @@ void make_table(int nchar, uchar bitlen[], int tablebits, ushort table[])
 		while (i != k) table[i++] = 0;
 	}
 
-	avail = nchar;
-	mask = 1U << (15 - tablebits);
+	avail = 1U << tablebits;
+	mask = (1U << jutbits) - 1;
 	for (ch = 0; ch < nchar; ch++) {
 		if ((len = bitlen[ch]) == 0) continue;
 		nextcode = start[len] + weight[len];
@@ -39,18 +50,13 @@ void make_table(int nchar, uchar bitlen[], int tablebits, ushort table[])
 		} else {
 			k = start[len];
 			p = &table[k >> jutbits];
-			i = len - tablebits;
-			while (i != 0) {
-				if (*p == 0) {
-					right[avail] = left[avail] = 0;
-					*p = avail++;
-				}
-				if (k & mask) p = &right[*p];
-				else          p = &left[*p];
-				k <<= 1;  i--;
+			if (*p == 0) {
+				*p = nchar + avail;  avail += mask + 1;
 			}
-			*p = ch;
+			p = &table[*p - nchar + (k & mask)];
+			for (i = weight[len]; i != 0; i--) *p++ = ch;
 		}
 		start[len] = nextcode;
 	}
+	return 1;
 }
@@ -3,108 +3,167 @@
 ***********************************************************/
 #include "ar.h"
 
-static int    n, heapsize;
-static short  heap[NC + 1];
-static ushort *freq, *sortptr, len_cnt[17];
-static uchar  *len;
+#define MAXLEN   16  /* longest code */
+#define SMALLSORT 32  /* fewer symbols than this: insertion sort */
 
-static void count_len(int i)  /* call with i = root */
+static int sort_freq(ar_state *s, int n, ushort freq[])
+	/* s->sym[0 .. m-1] = the m symbols with a count, fewest
+	   first, in order of symbol among equal counts.  Returns m. */
 {
-	static int depth = 0;
+	int i, j, m, c;
+	uint count[UCHAR_MAX + 1], k, x;
 
-	if (i < n) len_cnt[(depth < 16) ? depth : 16]++;
-	else {
-		depth++;
-		count_len(left [i]);
-		count_len(right[i]);
-		depth--;
+	m = 0;
+	if (n <= SMALLSORT) {
+		for (i = 0; i < n; i++) {
+			if ((x = freq[i]) == 0) continue;
+			for (j = m++; j > 0 && freq[s->sym[j - 1]] > x; j--)
+				s->sym[j] = s->sym[j - 1];
+			s->sym[j] = i;
+		}
+		return m;
+	}
+	/* two-pass radix sort, low byte then high byte */
+	for (c = 0; c <= UCHAR_MAX; c++) count[c] = 0;
+	x = 0;
+	for (i = 0; i < n; i++)
+		if (freq[i] != 0) {
+			count[freq[i] & UCHAR_MAX]++;  m++;  x |= freq[i];
+		}
+	for (c = 0, k = 0; c <= UCHAR_MAX; c++) {
+		j = count[c];  count[c] = k;  k += j;
+	}
+	for (i = 0; i < n; i++)
+		if (freq[i] != 0) s->tmp[count[freq[i] & UCHAR_MAX]++] = i;
+	if (x <= UCHAR_MAX) {  /* one byte was enough */
+		for (i = 0; i < m; i++) s->sym[i] = s->tmp[i];
+		return m;
 	}
+	for (c = 0; c <= UCHAR_MAX; c++) count[c] = 0;
+	for (i = 0; i < m; i++) count[freq[s->tmp[i]] >> CHAR_BIT]++;
+	for (c = 0, k = 0; c <= UCHAR_MAX; c++) {
+		j = count[c];  count[c] = k;  k += j;
+	}
+	for (i = 0; i < m; i++)
+		s->sym[count[freq[s->tmp[i]] >> CHAR_BIT]++] = s->tmp[i];
+	return m;
 }
 
-static void make_len(int root)
+static int min_len(ulong a[], int m)
+	/* a[0 .. m-1]: counts in increasing order, m >= 2.  Replaced
+	   by their code lengths, with no limit; returns the longest.
+	   (Moffat and Katajainen, in place: the tree is built in
+	   a[] as parent pointers, which then become depths.) */
 {
-	int i, k;
-	uint cum;
+	int root, leaf, next, avail, used, depth;
 
-	for (i = 0; i <= 16; i++) len_cnt[i] = 0;
-	count_len(root);
-	cum = 0;
-	for (i = 16; i > 0; i--)
-		cum += len_cnt[i] << (16 - i);
-	while (cum != (1U << 16)) {
-		fprintf(stderr, "17");
-		len_cnt[16]--;
-		for (i = 15; i > 0; i--) {
-			if (len_cnt[i] != 0) {
-				len_cnt[i]--;  len_cnt[i+1] += 2;  break;
-			}
-		}
-		cum--;
+	a[0] += a[1];  root = 0;  leaf = 2;
+	for (next = 1; next < m - 1; next++) {
+		if (leaf >= m || a[root] < a[leaf]) {  /* first child */
+			a[next] = a[root];  a[root++] = next;
+		} else a[next] = a[leaf++];
+		if (leaf >= m || (root < next && a[root] < a[leaf])) {
+			a[next] += a[root];  a[root++] = next;  /* second */
+		} else a[next] += a[leaf++];
 	}
-	for (i = 16; i > 0; i--) {
-		k = len_cnt[i];
-		while (--k >= 0) len[*sortptr++] = i;
+	a[m - 2] = 0;
+	for (next = m - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+	avail = 1;  used = depth = 0;  root = m - 2;  next = m - 1;
+	while (avail > 0) {
+		while (root >= 0 && a[root] == depth) {  used++;  root--;  }
+		while (avail > used) {  a[next--] = depth;  avail--;  }
+		avail = 2 * used;  depth++;  used = 0;
 	}
+	return (int)a[0];
 }
 
-static void downheap(int i)
-	/* priority queue; send i-th entry down heap */
+static int merge(ar_state *s, ushort freq[], int m,
+				 ulong src[], int nsrc, ulong dst[], int max, int *leaves)
+	/* dst[] = the counts of the m leaves merged with the sums
+	   of pairs in src[], first max of them; *leaves of these
+	   are leaves.  Returns how many went to dst[]. */
 {
-	int j, k;
+	int i, j, k;
+	ulong w;
 
-	k = heap[i];
-	while ((j = 2 * i) <= heapsize) {
-		if (j < heapsize && freq[heap[j]] > freq[heap[j + 1]])
-		 	j++;
-		if (freq[k] <= freq[heap[j]]) break;
-		heap[i] = heap[j];  i = j;
+	i = j = 0;
+	for (k = 0; k < max; k++) {
+		if (j + 1 < nsrc) {
+			w = src[j] + src[j + 1];
+			if (i < m && freq[s->sym[i]] <= w) dst[k] = freq[s->sym[i++]];
+			else {  dst[k] = w;  j += 2;  }
+		} else if (i < m) dst[k] = freq[s->sym[i++]];
+		else break;
 	}
-	heap[i] = k;
+	*leaves = i;
+	return k;
 }
 
-static void make_code(int n, uchar len[], ushort code[])
+static void limit_len(ar_state *s, ushort freq[], uchar len[], int m)
+	/* Lengths of at most MAXLEN bits, fewest bits in all
+	   (package-merge).  The list for depth d is the leaves
+	   merged with pairs from the list for d + 1, and the
+	   first 2m - 2 items at depth 1 are taken.  A leaf's
+	   length is how many of the taken parts it is in.  Each
+	   list is made again from the deepest one, so only two
+	   are kept; this is rare and the work is still small. */
+{
+	int i, d, j, k, nsrc, leaves;
+	ulong *src, *dst, *t;
+
+	for (i = 0; i < m; i++) len[s->sym[i]] = 0;
+	k = 2 * m - 2;
+	for (d = 1; d <= MAXLEN && k > 0; d++) {
+		src = s->list[0];  dst = s->list[1];
+		for (i = 0; i < m; i++) src[i] = freq[s->sym[i]];
+		nsrc = m;  /* depth MAXLEN: the leaves alone */
+		for (j = MAXLEN - 1; j > d; j--) {
+			nsrc = merge(s, freq, m, src, nsrc, dst, 2 * m - 2, &leaves);
+			t = src;  src = dst;  dst = t;
+		}
+		if (d == MAXLEN) leaves = (k < m) ? k : m;
+		else merge(s, freq, m, src, nsrc, dst, k, &leaves);
+		for (i = 0; i < leaves; i++) len[s->sym[i]]++;
+		k = 2 * (k - leaves);
+	}
+}
+
+static void make_code(ar_state *s, int n, uchar len[], ushort code[])
 {
 	int    i;
 	ushort start[18];
 
-	start[1] = 0;
+	for (i = 0; i <= MAXLEN; i++) s->len_cnt[i] = 0;
+	for (i = 0; i < n; i++) s->len_cnt[len[i]]++;
+	start[0] = start[1] = 0;
 	for (i = 1; i <= 16; i++)
-		start[i + 1] = (start[i] + len_cnt[i]) << 1;
+		start[i + 1] = (start[i] + s->len_cnt[i]) << 1;
 	for (i = 0; i < n; i++) code[i] = start[len[i]]++;
 }
 
-int make_tree(int nparm, ushort freqparm[],
+int make_tree(ar_state *s, int nparm, ushort freqparm[],
 				uchar lenparm[], ushort codeparm[])
-	/* make tree, calculate len[], return root */
+	/* Make len[] and code[] for the counts in freq[0..n-1].
+	   With two or more symbols returns n + m - 2 (m symbols
+	   counted), where freq[] gets their sum; as before, that
+	   was the root of the tree.  With one, returns it (its
+	   len[] 0).  freq[] must have room for 2n - 1. */
 {
-	int i, j, k, avail;
+	int i, m;
+	ulong *a, sum;
 
-	n = nparm;  freq = freqparm;  len = lenparm;
-	avail = n;  heapsize = 0;  heap[1] = 0;
-	for (i = 0; i < n; i++) {
-		len[i] = 0;
-		if (freq[i]) heap[++heapsize] = i;
-	}
-	if (heapsize < 2) {
-		codeparm[heap[1]] = 0;  return heap[1];
+	for (i = 0; i < nparm; i++) lenparm[i] = 0;
+	m = sort_freq(s, nparm, freqparm);
+	if (m < 2) {
+		i = (m == 0) ? 0 : s->sym[0];
+		codeparm[i] = 0;  return i;
 	}
-	for (i = heapsize / 2; i >= 1; i--)
-		downheap(i);  /* make priority queue */
-	sortptr = codeparm;
-	do {  /* while queue has at least two entries */
-		i = heap[1];  /* take out least-freq entry */
-		if (i < n) *sortptr++ = i;
-		heap[1] = heap[heapsize--];
-		downheap(1);
-		j = heap[1];  /* next least-freq entry */
-		if (j < n) *sortptr++ = j;
-		k = avail++;  /* generate new node */
-		freq[k] = freq[i] + freq[j];
-		heap[1] = k;  downheap(1);  /* put into queue */
-		left[k] = i;  right[k] = j;
-	} while (heapsize > 1);
-	sortptr = codeparm;
-	make_len(k);
-	make_code(nparm, lenparm, codeparm);
-	return k;  /* return root */
+	a = s->list[0];  sum = 0;
+	for (i = 0; i < m; i++) sum += a[i] = freqparm[s->sym[i]];
+	if (min_len(a, m) <= MAXLEN)
+		for (i = 0; i < m; i++) lenparm[s->sym[i]] = (uchar)a[i];
+	else limit_len(s, freqparm, lenparm, m);
+	make_code(s, nparm, lenparm, codeparm);
+	freqparm[nparm + m - 2] = (ushort)sum;
+	return nparm + m - 2;
 }